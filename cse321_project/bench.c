@@ -0,0 +1,545 @@
+/*
+ * bench.c - Throughput and latency benchmarks for mkfs, journal and validator
+ *
+ * Runs the real tools against a scratch image in a work directory and
+ * prints one JSON object per benchmark on stdout:
+ *
+ *   create    ops/sec and p50/p99/max latency of creates sent to a
+ *             journal server, plus log bytes and bytes written per create
+ *   install   time (and bytes written) to install a log filled to 25, 50,
+ *             75 and 95% of its capacity
+ *   validate  validator scan time with the default thread count, one
+ *             thread, and the pread path
+ *
+ * Requests go through `journal serve`, so latencies are those of the warm
+ * metadata cache without process start-up. Bytes written come from the
+ * server's write syscalls (/proc/<pid>/io wchar, less the replies it sent
+ * us), which includes log, header, home-location and manifest writes.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vsfs.h"
+
+#define SOCKET_NAME      "bench.sock"
+#define SOURCE_NAME      "bench.src"
+#define IMAGE_NAME       "vsfs.img"
+/* The root directory holds DIRECT_POINTERS blocks of entries less "." and ".."; keep a margin */
+#define MAX_ROOT_FILES   (DIRECT_POINTERS * DIRENTS_PER_BLOCK - 24U)
+
+struct config {
+    const char *blocks;
+    const char *inodes;
+    const char *journal_blocks;
+    const char *sync;
+    int pread_io;
+    uint32_t creates;
+    char tools[PATH_MAX];
+    char workdir[PATH_MAX];
+};
+
+struct server {
+    pid_t pid;
+    int fd;
+    FILE *in;
+    uint64_t reply_bytes;   /* bytes it has sent us */
+};
+
+static struct config cfg = {
+    .blocks = NULL,
+    .inodes = "1024",
+    .journal_blocks = "16",
+    .sync = "commit",
+    .creates = 1000,
+};
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+static void work_path(char *buf, size_t len, const char *name) {
+    if (snprintf(buf, len, "%s/%s", cfg.workdir, name) >= (int)len) {
+        fprintf(stderr, "work directory path too long\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Starts tool with args in the work directory, output discarded */
+static pid_t spawn(const char *tool, const char *const args[]) {
+    char path[PATH_MAX];
+    const char *argv[16];
+    int n = 0;
+
+    if (snprintf(path, sizeof(path), "%s/%s", cfg.tools, tool) >= (int)sizeof(path)) {
+        fprintf(stderr, "tool path too long\n");
+        exit(EXIT_FAILURE);
+    }
+    argv[n++] = path;
+    for (int i = 0; args[i] != NULL && n < 15; ++i) {
+        argv[n++] = args[i];
+    }
+    argv[n] = NULL;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        die("fork");
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (chdir(cfg.workdir) < 0 || null < 0) {
+            _exit(127);
+        }
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execv(path, (char *const *)argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+/* Runs tool to completion; returns its exit status and sets *elapsed_us */
+static int run(const char *tool, const char *const args[], double *elapsed_us) {
+    double start = now_us();
+    int status;
+    pid_t pid = spawn(tool, args);
+    if (waitpid(pid, &status, 0) < 0) {
+        die("waitpid");
+    }
+    if (elapsed_us) {
+        *elapsed_us = now_us() - start;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+}
+
+static void make_image(void) {
+    const char *args[12];
+    int n = 0;
+    if (cfg.blocks) {
+        args[n++] = "-b";
+        args[n++] = cfg.blocks;
+    }
+    args[n++] = "-i";
+    args[n++] = cfg.inodes;
+    args[n++] = "-j";
+    args[n++] = cfg.journal_blocks;
+    args[n++] = IMAGE_NAME;
+    args[n] = NULL;
+    if (run("mkfs", args, NULL) != 0) {
+        fprintf(stderr, "mkfs failed for this geometry\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void read_header(struct superblock *sb, struct journal_header *jh) {
+    char path[PATH_MAX];
+    work_path(path, sizeof(path), IMAGE_NAME);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        die("open image");
+    }
+    if (pread(fd, sb, sizeof(*sb), 0) != (ssize_t)sizeof(*sb) || sb->magic != FS_MAGIC) {
+        fprintf(stderr, "image has no valid superblock\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pread(fd, jh, sizeof(*jh), (off_t)sb->journal_block * BLOCK_SIZE) != (ssize_t)sizeof(*jh)) {
+        die("read journal header");
+    }
+    close(fd);
+}
+
+static uint64_t journal_capacity(const struct superblock *sb) {
+    return (uint64_t)vsfs_journal_blocks(sb) * BLOCK_SIZE - sizeof(struct journal_header);
+}
+
+/* Bytes the process has passed to write syscalls so far */
+static uint64_t written_bytes(pid_t pid) {
+    char path[64];
+    char line[128];
+    unsigned long long wchar = 0;
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "wchar: %llu", &wchar) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return wchar;
+}
+
+static void start_server(struct server *srv) {
+    char sock_path[PATH_MAX];
+    char sync_opt[64];
+    const char *args[8];
+    int n = 0;
+    struct sockaddr_un addr;
+
+    snprintf(sync_opt, sizeof(sync_opt), "--sync=%s", cfg.sync);
+    args[n++] = sync_opt;
+    args[n++] = "--data=journal";
+    args[n++] = cfg.pread_io ? "--io=pread" : "--io=mmap";
+    args[n++] = "serve";
+    args[n++] = SOCKET_NAME;
+    args[n] = NULL;
+
+    work_path(sock_path, sizeof(sock_path), SOCKET_NAME);
+    unlink(sock_path);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, sock_path);
+
+    srv->pid = spawn("journal", args);
+    srv->reply_bytes = 0;
+    for (int tries = 0; tries < 500; ++tries) {
+        srv->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (srv->fd < 0) {
+            die("socket");
+        }
+        if (connect(srv->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            srv->in = fdopen(dup(srv->fd), "r");
+            if (!srv->in) {
+                die("fdopen");
+            }
+            return;
+        }
+        close(srv->fd);
+        usleep(10000);
+    }
+    fprintf(stderr, "journal server did not start\n");
+    exit(EXIT_FAILURE);
+}
+
+/* Sends one command line and waits for its "= <status>" line */
+static int request(struct server *srv, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static int request(struct server *srv, const char *fmt, ...) {
+    char line[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    va_end(ap);
+    line[len++] = '\n';
+    for (int off = 0; off < len;) {
+        ssize_t n = write(srv->fd, line + off, (size_t)(len - off));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            die("write request");
+        }
+        off += (int)n;
+    }
+    while (fgets(line, sizeof(line), srv->in)) {
+        srv->reply_bytes += strlen(line);
+        if (strncmp(line, "= ", 2) == 0) {
+            return atoi(line + 2);
+        }
+    }
+    fprintf(stderr, "journal server closed the connection\n");
+    exit(EXIT_FAILURE);
+}
+
+/* Bytes the server wrote since *mark, other than its replies to us */
+static uint64_t server_output(struct server *srv, uint64_t *mark, uint64_t *reply_mark) {
+    uint64_t total = written_bytes(srv->pid);
+    uint64_t written = total - *mark - (srv->reply_bytes - *reply_mark);
+    *mark = total;
+    *reply_mark = srv->reply_bytes;
+    return written;
+}
+
+static void stop_server(struct server *srv) {
+    request(srv, "shutdown");
+    fclose(srv->in);
+    close(srv->fd);
+    waitpid(srv->pid, NULL, 0);
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, uint32_t n, uint32_t pct) {
+    uint64_t i = (uint64_t)n * pct / 100;
+    return sorted[i < n ? i : n - 1];
+}
+
+/* Prints the fields every result line starts with */
+static void print_config(const char *bench) {
+    struct superblock sb;
+    struct journal_header jh;
+    read_header(&sb, &jh);
+    printf("{\"bench\":\"%s\",\"blocks\":%u,\"inodes\":%u,\"journal_blocks\":%u,\"sync\":\"%s\",\"io\":\"%s\"",
+           bench, sb.total_blocks, sb.inode_count, vsfs_journal_blocks(&sb), cfg.sync,
+           cfg.pread_io ? "pread" : "mmap");
+}
+
+static void print_bytes(const char *name, uint64_t bytes, uint32_t ops) {
+    if (ops > 0) {
+        printf(",\"%s\":%.1f", name, (double)bytes / ops);
+    } else {
+        printf(",\"%s\":null", name);
+    }
+}
+
+static void bench_create(void) {
+    struct server srv;
+    struct superblock sb;
+    struct journal_header before;
+    struct journal_header after;
+    uint32_t failed = 0;
+    uint64_t mark;
+    uint64_t reply_mark;
+    double *lat = malloc(cfg.creates * sizeof(double));
+    if (!lat) {
+        die("malloc");
+    }
+
+    make_image();
+    start_server(&srv);
+    read_header(&sb, &before);
+    mark = written_bytes(srv.pid);
+    reply_mark = srv.reply_bytes;
+
+    double start = now_us();
+    for (uint32_t i = 0; i < cfg.creates; ++i) {
+        double t = now_us();
+        if (request(&srv, "create c%u", i) != 0) {
+            failed++;
+        }
+        lat[i] = now_us() - t;
+    }
+    double elapsed = now_us() - start;
+    uint64_t create_bytes = server_output(&srv, &mark, &reply_mark);
+    read_header(&sb, &after);
+
+    double t = now_us();
+    request(&srv, "install");
+    double install_us = now_us() - t;
+    uint64_t install_bytes = server_output(&srv, &mark, &reply_mark);
+    stop_server(&srv);
+
+    qsort(lat, cfg.creates, sizeof(double), compare_double);
+    print_config("create");
+    printf(",\"ops\":%u,\"failed\":%u,\"ops_per_sec\":%.0f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f",
+           cfg.creates, failed, cfg.creates / (elapsed / 1e6), percentile(lat, cfg.creates, 50),
+           percentile(lat, cfg.creates, 99), lat[cfg.creates - 1]);
+    printf(",\"log_bytes_per_op\":%.1f", (double)(after.head - before.head) / cfg.creates);
+    print_bytes("written_bytes_per_op", create_bytes, cfg.creates);
+    printf(",\"install_ms\":%.2f", install_us / 1e3);
+    print_bytes("install_bytes_per_op", install_bytes, cfg.creates);
+    printf("}\n");
+    fflush(stdout);
+    free(lat);
+}
+
+/*
+ * Fills the log to pct of its capacity with creates and then data-journaled
+ * 4 KiB writes, stopping before anything would be checkpointed, and times
+ * the install of all of it.
+ */
+static void bench_install(uint32_t pct) {
+    struct server srv;
+    struct superblock sb;
+    struct journal_header jh;
+    uint32_t files = 0;
+    uint32_t ops = 0;
+    uint64_t mark;
+    uint64_t reply_mark;
+
+    make_image();
+    start_server(&srv);
+    read_header(&sb, &jh);
+    uint64_t capacity = journal_capacity(&sb);
+    uint32_t max_files = sb.inode_count - 1 < MAX_ROOT_FILES ? sb.inode_count - 1 : MAX_ROOT_FILES;
+
+    while ((jh.head - jh.tail) * 100 < capacity * pct) {
+        uint64_t used = jh.head - jh.tail;
+        int status;
+        if (files < max_files) {
+            status = request(&srv, "create f%u", files);
+            files++;
+        } else if (files > 0) {
+            status = request(&srv, "write f%u " SOURCE_NAME, ops % files);
+        } else {
+            break;
+        }
+        ops++;
+        read_header(&sb, &jh);
+        /* The next write would not fit: stop at the fill reached so far */
+        if (status != 0 || jh.tail != 0 || (jh.head - jh.tail) + (jh.head - jh.tail - used) > capacity) {
+            break;
+        }
+    }
+    uint64_t used = jh.head - jh.tail;
+    mark = written_bytes(srv.pid);
+    reply_mark = srv.reply_bytes;
+
+    double t = now_us();
+    request(&srv, "install");
+    double install_us = now_us() - t;
+    uint64_t install_bytes = server_output(&srv, &mark, &reply_mark);
+    stop_server(&srv);
+
+    print_config("install");
+    printf(",\"target_fill_pct\":%u,\"fill_pct\":%.1f,\"log_bytes\":%llu,\"transactions\":%u,\"install_ms\":%.2f",
+           pct, 100.0 * (double)used / (double)capacity, (unsigned long long)used, ops, install_us / 1e3);
+    print_bytes("install_bytes", install_bytes, 1);
+    printf("}\n");
+    fflush(stdout);
+}
+
+/* Validates the image the install benchmarks left behind */
+static void bench_validate(void) {
+    const char *parallel[] = { IMAGE_NAME, NULL };
+    const char *single[] = { "--threads=1", IMAGE_NAME, NULL };
+    const char *pread_path[] = { "--io=pread", IMAGE_NAME, NULL };
+    double parallel_us;
+    double single_us;
+    double pread_us;
+
+    /* One untimed run to warm the page cache */
+    int status = run("validator", parallel, NULL);
+    run("validator", parallel, &parallel_us);
+    run("validator", single, &single_us);
+    run("validator", pread_path, &pread_us);
+
+    print_config("validate");
+    printf(",\"consistent\":%s,\"scan_ms\":%.2f,\"scan_ms_1_thread\":%.2f,\"scan_ms_pread\":%.2f}\n",
+           status == 0 ? "true" : "false", parallel_us / 1e3, single_us / 1e3, pread_us / 1e3);
+    fflush(stdout);
+}
+
+static void write_source(void) {
+    char path[PATH_MAX];
+    uint8_t data[BLOCK_SIZE];
+    work_path(path, sizeof(path), SOURCE_NAME);
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        die("create source file");
+    }
+    for (uint32_t i = 0; i < BLOCK_SIZE; ++i) {
+        data[i] = (uint8_t)(i * 31 + 7);
+    }
+    if (fwrite(data, 1, sizeof(data), f) != sizeof(data) || fclose(f) != 0) {
+        die("write source file");
+    }
+}
+
+static void cleanup(void) {
+    const char *names[] = { IMAGE_NAME, IMAGE_NAME ".dirty", SOCKET_NAME, SOURCE_NAME };
+    char path[PATH_MAX];
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        work_path(path, sizeof(path), names[i]);
+        unlink(path);
+    }
+    rmdir(cfg.workdir);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-b blocks] [-i inodes] [-j journal_blocks] [-n creates]\n"
+                    "       [-s none|commit|group|async] [-m mmap|pread] [-t tool_dir] [-d work_dir]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    const char *tools = ".";
+    const char *workdir = NULL;
+    int opt;
+
+    cfg.pread_io = 1;
+    while ((opt = getopt(argc, argv, "b:i:j:n:s:m:t:d:")) != -1) {
+        switch (opt) {
+        case 'b':
+            cfg.blocks = optarg;
+            break;
+        case 'i':
+            cfg.inodes = optarg;
+            break;
+        case 'j':
+            cfg.journal_blocks = optarg;
+            break;
+        case 'n':
+            cfg.creates = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            cfg.sync = optarg;
+            break;
+        case 'm':
+            if (strcmp(optarg, "pread") != 0 && strcmp(optarg, "mmap") != 0) {
+                usage(argv[0]);
+            }
+            cfg.pread_io = strcmp(optarg, "pread") == 0;
+            break;
+        case 't':
+            tools = optarg;
+            break;
+        case 'd':
+            workdir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || cfg.creates == 0) {
+        usage(argv[0]);
+    }
+    if (cfg.creates > MAX_ROOT_FILES) {
+        fprintf(stderr, "at most %u creates fit in the root directory\n", MAX_ROOT_FILES);
+        return EXIT_FAILURE;
+    }
+    if (!realpath(tools, cfg.tools)) {
+        die("tool directory");
+    }
+    if (workdir) {
+        if (!realpath(workdir, cfg.workdir)) {
+            die("work directory");
+        }
+    } else {
+        strcpy(cfg.workdir, "/tmp/vsfs-bench.XXXXXX");
+        if (!mkdtemp(cfg.workdir)) {
+            die("mkdtemp");
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    write_source();
+    bench_create();
+    static const uint32_t fills[] = { 25, 50, 75, 95 };
+    for (size_t i = 0; i < sizeof(fills) / sizeof(fills[0]); ++i) {
+        bench_install(fills[i]);
+    }
+    bench_validate();
+
+    if (!workdir) {
+        cleanup();
+    }
+    return 0;
+}
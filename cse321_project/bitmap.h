@@ -0,0 +1,166 @@
+/*
+ * bitmap.h - Bit operations on the inode and data bitmaps
+ *
+ * Bit i lives in byte i / 8 at position i % 8, so a little-endian 64-bit
+ * load of eight bytes holds 64 bits in order and ctz finds the lowest one.
+ * Runs of full (or empty) bytes are skipped 32 bytes at a time with AVX2
+ * when the CPU has it, or 16 at a time with SSE2 on any x86-64. Searches
+ * take a half-open bit range [start, end) and return end when nothing
+ * matches, so callers can resume a search from wherever they stopped,
+ * such as a rotating allocation hint.
+ */
+#ifndef VSFS_BITMAP_H
+#define VSFS_BITMAP_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define BITMAP_X86 1
+
+/* Set before main runs, so threads only ever read it */
+static int bitmap_have_avx2;
+
+__attribute__((constructor)) static void bitmap_detect_cpu(void) {
+    __builtin_cpu_init();
+    bitmap_have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+}
+#endif
+
+static inline int bitmap_test(const uint8_t *bitmap, uint32_t index) {
+    return (bitmap[index / 8] >> (index % 8)) & 0x1;
+}
+
+static inline void bitmap_set(uint8_t *bitmap, uint32_t index) {
+    bitmap[index / 8] |= (uint8_t)(1U << (index % 8));
+}
+
+static inline void bitmap_clear(uint8_t *bitmap, uint32_t index) {
+    bitmap[index / 8] &= (uint8_t)~(1U << (index % 8));
+}
+
+/* Sets (value 1) or clears bits [start, end), whole bytes at a time in between */
+static inline void bitmap_fill(uint8_t *bitmap, uint32_t start, uint32_t end, int value) {
+    while (start < end && start % 8 != 0) {
+        value ? bitmap_set(bitmap, start) : bitmap_clear(bitmap, start);
+        start++;
+    }
+    if (end - start >= 8) {
+        memset(bitmap + start / 8, value ? 0xFF : 0x00, (end - start) / 8);
+        start += (end - start) / 8 * 8;
+    }
+    while (start < end) {
+        value ? bitmap_set(bitmap, start) : bitmap_clear(bitmap, start);
+        start++;
+    }
+}
+
+/* Loads the 64 bits starting at byte; bytes at or past nbytes read as zero */
+static inline uint64_t bitmap_word(const uint8_t *bitmap, uint64_t byte, uint64_t nbytes) {
+    uint64_t w = 0;
+    if (byte + 8 <= nbytes) {
+        memcpy(&w, bitmap + byte, sizeof(w));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        w = __builtin_bswap64(w);
+#endif
+        return w;
+    }
+    for (uint64_t i = 0; byte + i < nbytes; ++i) {
+        w |= (uint64_t)bitmap[byte + i] << (8 * i);
+    }
+    return w;
+}
+
+#ifdef BITMAP_X86
+__attribute__((target("avx2")))
+static inline uint64_t bitmap_skip_avx2(const uint8_t *bitmap, uint64_t byte, uint64_t limit, uint8_t fill) {
+    const __m256i pattern = _mm256_set1_epi8((char)fill);
+    while (byte + 32 <= limit) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(bitmap + byte));
+        if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pattern)) != 0xFFFFFFFFU) {
+            break;
+        }
+        byte += 32;
+    }
+    return byte;
+}
+
+static inline uint64_t bitmap_skip_sse2(const uint8_t *bitmap, uint64_t byte, uint64_t limit, uint8_t fill) {
+    const __m128i pattern = _mm_set1_epi8((char)fill);
+    while (byte + 16 <= limit) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(bitmap + byte));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, pattern)) != 0xFFFF) {
+            break;
+        }
+        byte += 16;
+    }
+    return byte;
+}
+#endif
+
+/*
+ * Returns the first 8-byte-aligned offset at or after byte (a multiple of
+ * 8) whose word is not all fill, stopping at limit.
+ */
+static inline uint64_t bitmap_skip(const uint8_t *bitmap, uint64_t byte, uint64_t limit, uint8_t fill) {
+#ifdef BITMAP_X86
+    byte = bitmap_have_avx2 ? bitmap_skip_avx2(bitmap, byte, limit, fill)
+                            : bitmap_skip_sse2(bitmap, byte, limit, fill);
+#endif
+    const uint64_t pattern = fill ? ~(uint64_t)0 : 0;
+    while (byte + 8 <= limit && bitmap_word(bitmap, byte, limit) == pattern) {
+        byte += 8;
+    }
+    return byte;
+}
+
+/* Returns the first bit in [start, end) equal to value, or end if none is */
+static inline uint32_t bitmap_find(const uint8_t *bitmap, uint32_t start, uint32_t end, int value) {
+    const uint64_t flip = value ? 0 : ~(uint64_t)0;
+    const uint64_t nbytes = ((uint64_t)end + 7) / 8;
+    uint64_t bit = start;
+
+    while (bit < end) {
+        uint64_t byte = bit / 64 * 8;
+        if (bit % 64 == 0) {
+            byte = bitmap_skip(bitmap, byte, nbytes / 8 * 8, value ? 0x00 : 0xFF);
+            bit = byte * 8;
+            if (bit >= end) {
+                break;
+            }
+        }
+        uint64_t w = (bitmap_word(bitmap, byte, nbytes) ^ flip) & (~(uint64_t)0 << (bit % 64));
+        if (w != 0) {
+            bit = byte * 8 + (uint64_t)__builtin_ctzll(w);
+            return bit < end ? (uint32_t)bit : end;
+        }
+        bit = byte * 8 + 64;
+    }
+    return end;
+}
+
+static inline uint32_t bitmap_find_zero(const uint8_t *bitmap, uint32_t start, uint32_t end) {
+    return bitmap_find(bitmap, start, end, 0);
+}
+
+/* True when no bit in [start, end) is set */
+static inline int bitmap_range_clear(const uint8_t *bitmap, uint32_t start, uint32_t end) {
+    return bitmap_find(bitmap, start, end, 1) == end;
+}
+
+/* Number of set bits in [start, end) */
+static inline uint32_t bitmap_count(const uint8_t *bitmap, uint32_t start, uint32_t end) {
+    const uint64_t nbytes = ((uint64_t)end + 7) / 8;
+    uint32_t count = 0;
+    for (uint64_t bit = start; bit < end; bit = bit / 64 * 64 + 64) {
+        uint64_t w = bitmap_word(bitmap, bit / 64 * 8, nbytes) & (~(uint64_t)0 << (bit % 64));
+        if (end - bit / 64 * 64 < 64) {
+            w &= ~(~(uint64_t)0 << (end % 64));
+        }
+        count += (uint32_t)__builtin_popcountll(w);
+    }
+    return count;
+}
+
+#endif
@@ -0,0 +1,536 @@
+/*
+ * blockdev.h - Disk image access shared by mkfs, journal and validator
+ *
+ * An image is opened either memory-mapped or through plain pread/pwrite.
+ * With the mapping, bdev_get() returns a pointer straight into it and
+ * nothing is copied; with the fallback it reads into the caller's buffer
+ * and returns that. Writes always go through pwrite: the mapping is
+ * read-only, so a full disk is an ENOSPC from the write rather than a
+ * SIGBUS on a sparse page, and fdatasync alone makes them durable. Every
+ * function returns 0 (or a pointer) on success and -1 (or NULL) with
+ * errno set on failure, so each tool keeps its own way of reporting
+ * errors.
+ *
+ * bdev_batch() takes many requests at once. Opened with BDEV_URING (and
+ * no mapping), they are queued on an io_uring and run in parallel;
+ * without one, from a kernel that lacks it or refuses it, they run one
+ * after another through pread/pwrite.
+ *
+ * BDEV_DIRECT also opens the image with O_DIRECT as direct_fd, for I/O
+ * that should not pass through the page cache. bdev_direct_io()
+ * uses it; offsets, lengths and buffers must all be multiples of
+ * BDEV_DIRECT_ALIGN. The compiling file needs _GNU_SOURCE for O_DIRECT.
+ */
+#ifndef VSFS_BLOCKDEV_H
+#define VSFS_BLOCKDEV_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define BDEV_HAVE_URING 1
+/* Pulled in through <linux/fs.h>; the tools define their own block size */
+#undef BLOCK_SIZE
+#undef BLOCK_SIZE_BITS
+#endif
+#endif
+
+#define BDEV_READ    0x0
+#define BDEV_WRITE   0x1    /* open read-write */
+#define BDEV_CREATE  0x2    /* create or truncate the image */
+#define BDEV_MMAP    0x4    /* map the image; falls back to pread/pwrite */
+#define BDEV_URING   0x8    /* batch through io_uring; falls back to pread/pwrite */
+#define BDEV_DIRECT  0x10   /* also open direct_fd with O_DIRECT */
+
+#define BDEV_DIRECT_ALIGN 4096
+
+#define BDEV_RING_ENTRIES 64
+
+struct bdev_ring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    void *sqes;             /* struct io_uring_sqe[entries] */
+    void *cqes;             /* struct io_uring_cqe[] */
+    void *sq_map, *cq_map;
+    size_t sq_len, cq_len, sqes_len;
+};
+
+struct blockdev {
+    int fd;
+    uint8_t *map;           /* NULL when using pread/pwrite */
+    uint64_t size;          /* image size in bytes */
+    uint32_t block_size;
+    int flags;
+    struct bdev_ring *ring; /* NULL unless BDEV_URING and the kernel allows it */
+    int direct_fd;          /* -1 unless BDEV_DIRECT */
+};
+
+/* One vectored request for bdev_batch() */
+struct bdev_request {
+    uint64_t offset;
+    const struct iovec *iov;
+    int iovcnt;
+};
+
+static inline void bdev_ring_free(struct bdev_ring *ring) {
+    if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map != NULL) munmap(ring->cq_map, ring->cq_len);
+    if (ring->sq_map != NULL) munmap(ring->sq_map, ring->sq_len);
+    close(ring->fd);
+    free(ring);
+}
+
+#ifdef BDEV_HAVE_URING
+/* Sets up bd->ring; on any failure leaves it NULL for the fallback */
+static inline void bdev_ring_setup(struct blockdev *bd) {
+    struct io_uring_params p;
+    struct bdev_ring *ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        return;
+    }
+    memset(&p, 0, sizeof(p));
+    ring->fd = (int)syscall(__NR_io_uring_setup, BDEV_RING_ENTRIES, &p);
+    if (ring->fd < 0) {
+        free(ring);
+        return;
+    }
+    ring->entries = p.sq_entries;
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_map = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sq_map == MAP_FAILED) ring->sq_map = NULL;
+        if (ring->cq_map == MAP_FAILED) ring->cq_map = NULL;
+        if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+        bdev_ring_free(ring);
+        return;
+    }
+    uint8_t *sq = ring->sq_map;
+    uint8_t *cq = ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = cq + p.cq_off.cqes;
+    bd->ring = ring;
+}
+#endif
+
+static inline int bdev_remap(struct blockdev *bd) {
+    if (bd->map != NULL) {
+        munmap(bd->map, bd->size);
+        bd->map = NULL;
+    }
+    if (!(bd->flags & BDEV_MMAP) || bd->size == 0) {
+        return 0;
+    }
+    void *map = mmap(NULL, bd->size, PROT_READ, MAP_SHARED, bd->fd, 0);
+    if (map != MAP_FAILED) {
+        bd->map = map;
+        if (bd->flags & BDEV_DIRECT) {
+            madvise(map, bd->size, MADV_RANDOM);
+        }
+    }
+    return 0;
+}
+
+static inline int bdev_open(struct blockdev *bd, const char *path, int flags, uint32_t block_size) {
+    int oflags = (flags & BDEV_WRITE) ? O_RDWR : O_RDONLY;
+    if (flags & BDEV_CREATE) {
+        oflags = O_RDWR | O_CREAT | O_TRUNC;
+        flags |= BDEV_WRITE;
+    }
+
+    memset(bd, 0, sizeof(*bd));
+    bd->direct_fd = -1;
+    bd->fd = open(path, oflags, 0644);
+    if (bd->fd < 0) {
+        return -1;
+    }
+    if (flags & BDEV_DIRECT) {
+#ifdef O_DIRECT
+        bd->direct_fd = open(path, (oflags & ~(O_CREAT | O_TRUNC)) | O_DIRECT);
+#else
+        errno = EINVAL;
+#endif
+        if (bd->direct_fd < 0) {
+            int err = errno;
+            close(bd->fd);
+            errno = err;
+            return -1;
+        }
+        /* No readahead either, or reading a neighbour caches the direct blocks */
+        posix_fadvise(bd->fd, 0, 0, POSIX_FADV_RANDOM);
+    }
+
+    struct stat st;
+    if (fstat(bd->fd, &st) < 0) {
+        if (bd->direct_fd >= 0) {
+            close(bd->direct_fd);
+        }
+        close(bd->fd);
+        return -1;
+    }
+    bd->size = (uint64_t)st.st_size;
+    bd->block_size = block_size;
+    bd->flags = flags;
+    if (bdev_remap(bd) < 0) {
+        return -1;
+    }
+#ifdef BDEV_HAVE_URING
+    if ((flags & BDEV_URING) && bd->map == NULL) {
+        bdev_ring_setup(bd);
+    }
+#endif
+    return 0;
+}
+
+/* Grows or shrinks the image and remaps it */
+static inline int bdev_resize(struct blockdev *bd, uint64_t size) {
+    if (ftruncate(bd->fd, (off_t)size) < 0) {
+        return -1;
+    }
+    if (bd->map != NULL) {
+        munmap(bd->map, bd->size);
+        bd->map = NULL;
+    }
+    bd->size = size;
+    return bdev_remap(bd);
+}
+
+/* Reserves disk space for the whole image, growing it to size if needed */
+static inline int bdev_allocate(struct blockdev *bd, uint64_t size) {
+    int err = posix_fallocate(bd->fd, 0, (off_t)size);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    if (bd->map != NULL) {
+        munmap(bd->map, bd->size);
+        bd->map = NULL;
+    }
+    bd->size = size;
+    return bdev_remap(bd);
+}
+
+static inline int bdev_check_range(const struct blockdev *bd, uint64_t offset, uint64_t len) {
+    if (offset > bd->size || len > bd->size - offset) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Returns len bytes at offset: a pointer into the mapping when there is
+ * one, otherwise buf after reading into it.
+ */
+static inline const void *bdev_get(struct blockdev *bd, uint64_t offset, void *buf, uint64_t len) {
+    if (bd->map != NULL) {
+        if (bdev_check_range(bd, offset, len) < 0) {
+            return NULL;
+        }
+        return bd->map + offset;
+    }
+    uint8_t *dst = buf;
+    while (len > 0) {
+        ssize_t n = pread(bd->fd, dst, len, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            return NULL;
+        }
+        dst += n;
+        offset += (uint64_t)n;
+        len -= (uint64_t)n;
+    }
+    return buf;
+}
+
+static inline int bdev_pread(struct blockdev *bd, uint64_t offset, void *buf, uint64_t len) {
+    const void *src = bdev_get(bd, offset, buf, len);
+    if (src == NULL) {
+        return -1;
+    }
+    if (src != buf) {
+        memcpy(buf, src, len);
+    }
+    return 0;
+}
+
+/* The shared mapping sees the written pages; it must not be outgrown */
+static inline int bdev_pwrite(struct blockdev *bd, uint64_t offset, const void *buf, uint64_t len) {
+    if (bd->map != NULL && bdev_check_range(bd, offset, len) < 0) {
+        return -1;
+    }
+    const uint8_t *src = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(bd->fd, src, len, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        src += n;
+        offset += (uint64_t)n;
+        len -= (uint64_t)n;
+    }
+    return 0;
+}
+
+/* Writes the buffers back to back starting at offset */
+static inline int bdev_pwritev(struct blockdev *bd, uint64_t offset, const struct iovec *iov, int iovcnt) {
+    uint64_t len = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        len += iov[i].iov_len;
+    }
+    if (bd->map != NULL && bdev_check_range(bd, offset, len) < 0) {
+        return -1;
+    }
+    while (iovcnt > 0) {
+        ssize_t n = pwritev(bd->fd, iov, iovcnt, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        offset += (uint64_t)n;
+        /* Short write: finish the partly written buffer, then carry on */
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (n > 0) {
+            if (bdev_pwrite(bd, offset, (const uint8_t *)iov->iov_base + n, iov->iov_len - (size_t)n) < 0) {
+                return -1;
+            }
+            offset += iov->iov_len - (size_t)n;
+            iov++;
+            iovcnt--;
+        }
+    }
+    return 0;
+}
+
+/* Fills the buffers back to back from offset */
+static inline int bdev_preadv(struct blockdev *bd, uint64_t offset, const struct iovec *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; ++i) {
+        if (bdev_pread(bd, offset, iov[i].iov_base, iov[i].iov_len) < 0) {
+            return -1;
+        }
+        offset += iov[i].iov_len;
+    }
+    return 0;
+}
+
+static inline int bdev_request_sync(struct blockdev *bd, int write, const struct bdev_request *req) {
+    return write ? bdev_pwritev(bd, req->offset, req->iov, req->iovcnt)
+                 : bdev_preadv(bd, req->offset, req->iov, req->iovcnt);
+}
+
+#ifdef BDEV_HAVE_URING
+/*
+ * Keeps up to a ring's worth of requests in flight until all are done.
+ * A request the kernel completed only in part is redone synchronously.
+ * Returns once nothing is in flight, even after an error, since the
+ * buffers belong to the caller.
+ */
+static inline int bdev_batch_ring(struct blockdev *bd, int write, const struct bdev_request *reqs, int n) {
+    struct bdev_ring *ring = bd->ring;
+    struct io_uring_sqe *sqes = ring->sqes;
+    struct io_uring_cqe *cqes = ring->cqes;
+    int queued = 0;
+    int done = 0;
+    int unsubmitted = 0;
+    int inflight = 0;
+    int err = 0;
+
+    while (done < n) {
+        unsigned tail = *ring->sq_tail;
+        while (queued < n && inflight < (int)ring->entries && err == 0) {
+            unsigned slot = tail & *ring->sq_mask;
+            struct io_uring_sqe *sqe = &sqes[slot];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = bd->fd;
+            sqe->addr = (uint64_t)(uintptr_t)reqs[queued].iov;
+            sqe->len = (uint32_t)reqs[queued].iovcnt;
+            sqe->off = reqs[queued].offset;
+            sqe->user_data = (uint64_t)queued;
+            ring->sq_array[slot] = slot;
+            tail++;
+            queued++;
+            inflight++;
+            unsubmitted++;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        if (inflight == 0) {
+            break;      /* an error stopped queueing and everything is back */
+        }
+
+        int rc = (int)syscall(__NR_io_uring_enter, ring->fd, unsubmitted, 1, IORING_ENTER_GETEVENTS,
+                              NULL, 0);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* Take back what the kernel never saw, and wait for the rest */
+            err = errno;
+            __atomic_store_n(ring->sq_tail, tail - (unsigned)unsubmitted, __ATOMIC_RELEASE);
+            inflight -= unsubmitted;
+            unsubmitted = 0;
+            continue;
+        }
+        unsubmitted -= rc < unsubmitted ? rc : unsubmitted;
+
+        unsigned head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &cqes[head & *ring->cq_mask];
+            const struct bdev_request *req = &reqs[cqe->user_data];
+            uint64_t len = 0;
+            for (int i = 0; i < req->iovcnt; ++i) {
+                len += req->iov[i].iov_len;
+            }
+            if (cqe->res < 0) {
+                err = -cqe->res;
+            } else if ((uint64_t)cqe->res < len && bdev_request_sync(bd, write, req) < 0) {
+                err = errno;
+            }
+            head++;
+            done++;
+            inflight--;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        if (err != 0 && inflight == 0) {
+            break;
+        }
+    }
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Reads (write == 0) or writes every request. With a ring they run in
+ * parallel, so requests must not overlap.
+ */
+static inline int bdev_batch(struct blockdev *bd, int write, const struct bdev_request *reqs, int n) {
+#ifdef BDEV_HAVE_URING
+    if (bd->ring != NULL && n > 1) {
+        return bdev_batch_ring(bd, write, reqs, n);
+    }
+#endif
+    for (int i = 0; i < n; ++i) {
+        if (bdev_request_sync(bd, write, &reqs[i]) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Reads or writes aligned buffers at an aligned offset through direct_fd,
+ * bypassing the page cache.
+ */
+static inline int bdev_direct_io(struct blockdev *bd, int write, uint64_t offset,
+                                 const struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = write ? pwritev(bd->direct_fd, iov, iovcnt, (off_t)offset)
+                          : preadv(bd->direct_fd, iov, iovcnt, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        offset += (uint64_t)n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (n > 0) {
+            /* Transfers stop on an aligned boundary, so the rest of this buffer is aligned too */
+            struct iovec rest = { (uint8_t *)iov->iov_base + n, iov->iov_len - (size_t)n };
+            if (bdev_direct_io(bd, write, offset, &rest, 1) < 0) {
+                return -1;
+            }
+            offset += rest.iov_len;
+            iov++;
+            iovcnt--;
+        }
+    }
+    return 0;
+}
+
+static inline const void *bdev_block(struct blockdev *bd, uint32_t block_no, void *buf) {
+    return bdev_get(bd, (uint64_t)block_no * bd->block_size, buf, bd->block_size);
+}
+
+static inline int bdev_read(struct blockdev *bd, uint32_t block_no, void *buf) {
+    return bdev_pread(bd, (uint64_t)block_no * bd->block_size, buf, bd->block_size);
+}
+
+static inline int bdev_write(struct blockdev *bd, uint32_t block_no, const void *buf) {
+    return bdev_pwrite(bd, (uint64_t)block_no * bd->block_size, buf, bd->block_size);
+}
+
+/* Makes every write issued so far durable */
+static inline int bdev_sync(struct blockdev *bd) {
+    return fdatasync(bd->fd);
+}
+
+static inline int bdev_close(struct blockdev *bd) {
+    if (bd->map != NULL) {
+        munmap(bd->map, bd->size);
+        bd->map = NULL;
+    }
+    if (bd->ring != NULL) {
+        bdev_ring_free(bd->ring);
+        bd->ring = NULL;
+    }
+    if (bd->direct_fd >= 0) {
+        close(bd->direct_fd);
+        bd->direct_fd = -1;
+    }
+    int rc = close(bd->fd);
+    bd->fd = -1;
+    return rc;
+}
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * bufpool.h - Page-aligned, recycled block buffers
+ *
+ * A pool hands out buffers of one fixed size, all aligned to
+ * BUF_POOL_ALIGN so they can be used for O_DIRECT I/O. Buffers are carved
+ * from chunks of BUF_POOL_CHUNK at a time and go back on a free list when
+ * put, so a steady workload stops allocating once the pool has grown to
+ * its working set. Chunks are only returned to the system by
+ * pool_release(). Every call takes the pool's mutex, so threads can share
+ * one pool.
+ */
+#ifndef VSFS_BUFPOOL_H
+#define VSFS_BUFPOOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define BUF_POOL_ALIGN 4096     /* page size, and enough for O_DIRECT on any device */
+#define BUF_POOL_CHUNK 64       /* buffers allocated at a time */
+
+struct buf_chunk {
+    struct buf_chunk *next;
+    void *mem;
+};
+
+struct buf_pool {
+    size_t size;                /* bytes per buffer, a multiple of BUF_POOL_ALIGN */
+    void *free;                 /* put buffers, linked through their first bytes */
+    struct buf_chunk *chunks;
+    uint8_t *next;              /* unused part of the newest chunk */
+    uint8_t *end;
+    pthread_mutex_t lock;
+};
+
+#define BUF_POOL_INIT(size) { (size), NULL, NULL, NULL, NULL, PTHREAD_MUTEX_INITIALIZER }
+
+/* Returns a buffer of pool->size bytes, or NULL when out of memory */
+static inline void *pool_get(struct buf_pool *pool) {
+    void *buf;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free != NULL) {
+        buf = pool->free;
+        pool->free = *(void **)buf;
+    } else {
+        if (pool->next == pool->end) {
+            struct buf_chunk *chunk = malloc(sizeof(*chunk));
+            if (chunk == NULL ||
+                posix_memalign(&chunk->mem, BUF_POOL_ALIGN, pool->size * BUF_POOL_CHUNK) != 0) {
+                free(chunk);
+                pthread_mutex_unlock(&pool->lock);
+                return NULL;
+            }
+            chunk->next = pool->chunks;
+            pool->chunks = chunk;
+            pool->next = chunk->mem;
+            pool->end = pool->next + pool->size * BUF_POOL_CHUNK;
+        }
+        buf = pool->next;
+        pool->next += pool->size;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return buf;
+}
+
+/* Gives a buffer from pool_get() back; NULL is ignored */
+static inline void pool_put(struct buf_pool *pool, void *buf) {
+    if (buf == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    *(void **)buf = pool->free;
+    pool->free = buf;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Frees every chunk; buffers still out become invalid */
+static inline void pool_release(struct buf_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->chunks != NULL) {
+        struct buf_chunk *chunk = pool->chunks;
+        pool->chunks = chunk->next;
+        free(chunk->mem);
+        free(chunk);
+    }
+    pool->free = NULL;
+    pool->next = NULL;
+    pool->end = NULL;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+#endif
@@ -0,0 +1,681 @@
+/*
+ * crash.c - Crash-injection and recovery-time harness for the journal
+ *
+ * Runs a create/write workload with the real tools on a scratch image in
+ * a work directory, then rebuilds the image as a crash at each point of
+ * the workload would have left it, and checks what recovery
+ * (`journal install`) makes of it:
+ *
+ *   append   the log loses everything from a record boundary on, or from
+ *            the middle of a record (a torn write), while the header
+ *            already claims it: what --sync=none and async leave to the
+ *            checksum. The lost bytes revert to what the area held
+ *            before the workload, stale records of an earlier pass
+ *            around the circular log included.
+ *   install  an install stops after each home-location write it makes,
+ *            in the order it makes them, before the header moves.
+ *
+ * After each recovery the validator must pass, the log must be empty at
+ * the right transaction, and every block outside the journal must equal
+ * a reference image: the workload image with the transactions committed
+ * before the cut checkpointed (append), or fully installed (install).
+ * Results are printed as JSON lines, as bench does: recovery time against
+ * the log bytes and transactions recovered, then a summary per phase.
+ */
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vsfs.h"
+
+#define SOURCE_NAME      "crash.src"
+#define IMAGE_NAME       "vsfs.img"
+#define MANIFEST_NAME    IMAGE_NAME ".dirty"
+/* The root directory holds DIRECT_POINTERS blocks of entries less "." and ".."; keep a margin */
+#define MAX_ROOT_FILES   (DIRECT_POINTERS * DIRENTS_PER_BLOCK - 24U)
+#define WARMUP_LIMIT     1000U
+
+/* Journal records as journal.c lays them out after the header */
+#define REC_COMMIT       2
+#define REC_PAD          4
+#define LOG_START        ((uint32_t)sizeof(struct journal_header))
+
+struct rec_header {
+    uint16_t type;
+    uint16_t size;
+};
+
+struct config {
+    const char *blocks;
+    const char *inodes;
+    const char *journal_blocks;
+    const char *sync;
+    const char *data;
+    uint32_t creates;
+    uint32_t writes;
+    uint32_t write_size;
+    int verbose;
+    char tools[PATH_MAX];
+    char workdir[PATH_MAX];
+};
+
+/* One record of the workload's log, by logical position */
+struct record {
+    uint64_t pos;
+    uint32_t size;
+    uint32_t commits;       /* commit records that end at or before pos */
+};
+
+struct image {
+    uint8_t *data;
+    size_t len;
+};
+
+struct phase {
+    const char *name;
+    uint32_t points;
+    uint32_t failures;
+    double *recovery_us;
+};
+
+static struct config cfg = {
+    .blocks = "2048",
+    .inodes = "256",
+    .journal_blocks = "16",
+    .sync = "commit",
+    .data = "ordered",
+    .creates = 100,
+    .writes = 20,
+    .write_size = 20000,
+};
+
+static struct superblock sb;
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+static void work_path(char *buf, size_t len, const char *name) {
+    if (snprintf(buf, len, "%s/%s", cfg.workdir, name) >= (int)len) {
+        fprintf(stderr, "work directory path too long\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Runs tool with args in the work directory, output discarded; returns its exit status */
+static int run(const char *tool, const char *const args[], double *elapsed_us) {
+    char path[PATH_MAX];
+    const char *argv[16];
+    int n = 0;
+    int status;
+
+    if (snprintf(path, sizeof(path), "%s/%s", cfg.tools, tool) >= (int)sizeof(path)) {
+        fprintf(stderr, "tool path too long\n");
+        exit(EXIT_FAILURE);
+    }
+    argv[n++] = path;
+    for (int i = 0; args[i] != NULL && n < 15; ++i) {
+        argv[n++] = args[i];
+    }
+    argv[n] = NULL;
+
+    double start = now_us();
+    pid_t pid = fork();
+    if (pid < 0) {
+        die("fork");
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (chdir(cfg.workdir) < 0 || null < 0) {
+            _exit(127);
+        }
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execv(path, (char *const *)argv);
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) < 0) {
+        die("waitpid");
+    }
+    if (elapsed_us) {
+        *elapsed_us = now_us() - start;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+}
+
+/* Runs one journal command with the configured --sync and --data modes */
+static int journal(const char *cmd, const char *arg1, const char *arg2, double *elapsed_us) {
+    char sync_opt[64];
+    char data_opt[64];
+    const char *args[] = { sync_opt, data_opt, cmd, arg1, arg2, NULL };
+
+    snprintf(sync_opt, sizeof(sync_opt), "--sync=%s", cfg.sync);
+    snprintf(data_opt, sizeof(data_opt), "--data=%s", cfg.data);
+    return run("journal", args, elapsed_us);
+}
+
+static void make_image(void) {
+    const char *args[] = { "-b", cfg.blocks, "-i", cfg.inodes, "-j", cfg.journal_blocks, IMAGE_NAME, NULL };
+    if (run("mkfs", args, NULL) != 0) {
+        fprintf(stderr, "mkfs failed for this geometry\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void load_image(struct image *img) {
+    char path[PATH_MAX];
+    work_path(path, sizeof(path), IMAGE_NAME);
+    FILE *f = fopen(path, "rb");
+    if (!f || fseek(f, 0, SEEK_END) != 0) {
+        die("open image");
+    }
+    long len = ftell(f);
+    rewind(f);
+    if (len < 0 || (img->data != NULL && (size_t)len != img->len)) {
+        fprintf(stderr, "image changed size\n");
+        exit(EXIT_FAILURE);
+    }
+    if (img->data == NULL) {
+        img->len = (size_t)len;
+        img->data = malloc(img->len);
+        if (!img->data) {
+            die("malloc");
+        }
+    }
+    if (fread(img->data, 1, img->len, f) != img->len) {
+        die("read image");
+    }
+    fclose(f);
+}
+
+/* Puts img in the work directory, without a dirty manifest */
+static void store_image(const struct image *img) {
+    char path[PATH_MAX];
+    work_path(path, sizeof(path), MANIFEST_NAME);
+    unlink(path);
+    work_path(path, sizeof(path), IMAGE_NAME);
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        die("create image");
+    }
+    if (fwrite(img->data, 1, img->len, f) != img->len || fclose(f) != 0) {
+        die("write image");
+    }
+}
+
+static void copy_image(struct image *to, const struct image *from) {
+    if (to->data == NULL) {
+        to->len = from->len;
+        to->data = malloc(to->len);
+        if (!to->data) {
+            die("malloc");
+        }
+    }
+    memcpy(to->data, from->data, from->len);
+}
+
+static struct journal_header header_of(const struct image *img) {
+    struct journal_header jh;
+    memcpy(&jh, img->data + (size_t)sb.journal_block * BLOCK_SIZE, sizeof(jh));
+    return jh;
+}
+
+static uint32_t capacity(void) {
+    return vsfs_journal_blocks(&sb) * BLOCK_SIZE - LOG_START;
+}
+
+static uint32_t log_offset(uint64_t pos) {
+    return LOG_START + (uint32_t)(pos % capacity());
+}
+
+static int in_journal(uint32_t block) {
+    return block >= sb.journal_block && block - sb.journal_block < vsfs_journal_blocks(&sb);
+}
+
+/* First block outside the journal where a and b differ, or total_blocks */
+static uint32_t first_difference(const struct image *a, const struct image *b) {
+    for (uint32_t blk = 0; blk < sb.total_blocks; ++blk) {
+        size_t off = (size_t)blk * BLOCK_SIZE;
+        if (!in_journal(blk) && memcmp(a->data + off, b->data + off, BLOCK_SIZE) != 0) {
+            return blk;
+        }
+    }
+    return sb.total_blocks;
+}
+
+/* Fills the source file with a pattern that differs for every seed */
+static void write_source(uint32_t seed) {
+    char path[PATH_MAX];
+    work_path(path, sizeof(path), SOURCE_NAME);
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        die("create source file");
+    }
+    for (uint32_t i = 0; i < cfg.write_size; ++i) {
+        if (fputc((int)((i * 31 + seed * 131 + 7) & 0xff), f) == EOF) {
+            die("write source file");
+        }
+    }
+    if (fclose(f) != 0) {
+        die("write source file");
+    }
+}
+
+/*
+ * Leaves stale records all around the log area: writes to one file until
+ * the log has gone around once, then installs. A lost record must then
+ * revert to old records that look valid but carry earlier txids.
+ */
+static void warm_up(void) {
+    struct image img = { NULL, 0 };
+    struct journal_header jh;
+
+    write_source(0);
+    if (journal("create", "stale", NULL, NULL) != 0) {
+        fprintf(stderr, "journal create failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < WARMUP_LIMIT; ++i) {
+        load_image(&img);
+        jh = header_of(&img);
+        if (jh.head >= capacity() || journal("write", "stale", SOURCE_NAME, NULL) != 0) {
+            break;
+        }
+    }
+    journal("install", NULL, NULL, NULL);
+    free(img.data);
+}
+
+static void workload(void) {
+    char name[32];
+
+    for (uint32_t i = 0; i < cfg.creates; ++i) {
+        snprintf(name, sizeof(name), "f%u", i);
+        if (journal("create", name, NULL, NULL) != 0) {
+            fprintf(stderr, "journal create %s failed\n", name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (uint32_t i = 0; i < cfg.writes; ++i) {
+        snprintf(name, sizeof(name), "f%u", i % cfg.creates);
+        write_source(i + 1);
+        if (journal("write", name, SOURCE_NAME, NULL) != 0) {
+            fprintf(stderr, "journal write %s failed\n", name);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* Lists the records in [tail, head), skipping padding the way replay does */
+static struct record *scan_log(const struct image *img, uint32_t *count) {
+    const uint8_t *area = img->data + (size_t)sb.journal_block * BLOCK_SIZE;
+    struct journal_header jh = header_of(img);
+    struct record *recs = NULL;
+    uint32_t n = 0;
+    uint32_t cap = 0;
+    uint32_t commits = 0;
+    uint64_t pos = jh.tail;
+
+    while (pos < jh.head) {
+        uint32_t offset = log_offset(pos);
+        uint32_t room = capacity() - (offset - LOG_START);
+        const struct rec_header *rec = (const struct rec_header *)(area + offset);
+
+        if (room < sizeof(*rec) || rec->type == REC_PAD) {
+            pos += room;
+            continue;
+        }
+        if (rec->size < sizeof(*rec) || rec->size > room) {
+            fprintf(stderr, "malformed record at journal position %llu\n", (unsigned long long)pos);
+            exit(EXIT_FAILURE);
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 256;
+            recs = realloc(recs, cap * sizeof(*recs));
+            if (!recs) {
+                die("realloc");
+            }
+        }
+        recs[n].pos = pos;
+        recs[n].size = rec->size;
+        recs[n].commits = commits;
+        n++;
+        if (rec->type == REC_COMMIT) {
+            commits++;
+        }
+        pos += rec->size;
+    }
+    *count = n;
+    return recs;
+}
+
+/* Prints the fields every result line starts with */
+static void print_config(const char *phase) {
+    printf("{\"bench\":\"crash\",\"phase\":\"%s\",\"blocks\":%u,\"inodes\":%u,\"journal_blocks\":%u,"
+           "\"sync\":\"%s\",\"data\":\"%s\"",
+           phase, sb.total_blocks, sb.inode_count, vsfs_journal_blocks(&sb), cfg.sync, cfg.data);
+}
+
+/*
+ * Stores img, recovers it and checks the result against want: the
+ * validator passes, the log is empty at transaction txid, and every block
+ * outside the journal matches. Prints a line when asked to or when the
+ * check fails.
+ */
+static void recover(struct phase *ph, const struct image *img, const struct image *want, uint32_t txid,
+                    const char *point, int print) {
+    static struct image got = { NULL, 0 };
+    const char *args[] = { IMAGE_NAME, NULL };
+    const char *error = NULL;
+    uint32_t blk = sb.total_blocks;
+    double us;
+
+    store_image(img);
+    int status = journal("install", NULL, NULL, &us);
+    int consistent = run("validator", args, NULL) == 0;
+    load_image(&got);
+    struct journal_header jh = header_of(&got);
+
+    if (status != 0) {
+        error = "install failed";
+    } else if (!consistent) {
+        error = "validator found errors";
+    } else if (jh.head != jh.tail || jh.tail_txid != txid) {
+        error = "log not empty at the expected transaction";
+    } else if ((blk = first_difference(&got, want)) != sb.total_blocks) {
+        error = "block differs from the reference image";
+    }
+
+    ph->recovery_us[ph->points++] = us;
+    if (error) {
+        ph->failures++;
+    }
+    if (print || error || cfg.verbose) {
+        print_config(ph->name);
+        printf(",%s,\"recovery_ms\":%.2f,\"ok\":%s", point, us / 1e3, error ? "false" : "true");
+        if (error) {
+            printf(",\"error\":\"%s\"", error);
+            if (blk != sb.total_blocks) {
+                printf(",\"block\":%u", blk);
+            }
+        }
+        printf("}\n");
+        fflush(stdout);
+    }
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_summary(struct phase *ph, const char *fields) {
+    qsort(ph->recovery_us, ph->points, sizeof(double), compare_double);
+    print_config(ph->name);
+    printf(",\"summary\":true,%s,\"points\":%u,\"failures\":%u", fields, ph->points, ph->failures);
+    if (ph->points > 0) {
+        printf(",\"recovery_ms_p50\":%.2f,\"recovery_ms_max\":%.2f",
+               ph->recovery_us[ph->points / 2] / 1e3, ph->recovery_us[ph->points - 1] / 1e3);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+/*
+ * Cuts the log at every record boundary and in the middle of every
+ * record, and once at the head (nothing lost). The header is the
+ * workload's, so recovery must find the end of the log from the records
+ * alone. The reference for a cut is the workload image with the
+ * transactions before it checkpointed; cuts come in log order, so each
+ * reference is made once.
+ */
+static uint32_t crash_append(const struct image *before, const struct image *work) {
+    const uint8_t *old_area = before->data + (size_t)sb.journal_block * BLOCK_SIZE;
+    struct journal_header jh = header_of(work);
+    struct image cut = { NULL, 0 };
+    struct image want = { NULL, 0 };
+    struct record *recs;
+    struct phase ph = { "append", 0, 0, NULL };
+    char point[160];
+    char fields[160];
+    char count[16];
+    uint32_t nrecs;
+    uint32_t want_commits = UINT32_MAX;
+
+    recs = scan_log(work, &nrecs);
+    ph.recovery_us = malloc((2 * (size_t)nrecs + 1) * sizeof(double));
+    if (!ph.recovery_us) {
+        die("malloc");
+    }
+
+    for (uint32_t i = 0; i <= nrecs; ++i) {
+        for (int torn = 0; torn <= 1; ++torn) {
+            if (i == nrecs && torn) {
+                break;
+            }
+            uint64_t at = (i < nrecs) ? recs[i].pos + (torn ? recs[i].size / 2 : 0) : jh.head;
+            uint32_t commits = (i < nrecs) ? recs[i].commits : (nrecs > 0 ? recs[nrecs - 1].commits + 1 : 0);
+
+            if (commits != want_commits) {
+                store_image(work);
+                snprintf(count, sizeof(count), "%u", commits);
+                if (commits > 0 && journal("checkpoint", count, NULL, NULL) != 0) {
+                    fprintf(stderr, "journal checkpoint %u failed\n", commits);
+                    exit(EXIT_FAILURE);
+                }
+                load_image(&want);
+                want_commits = commits;
+            }
+
+            copy_image(&cut, work);
+            uint8_t *area = cut.data + (size_t)sb.journal_block * BLOCK_SIZE;
+            for (uint64_t pos = at; pos < jh.head; ++pos) {
+                area[log_offset(pos)] = old_area[log_offset(pos)];
+            }
+
+            snprintf(point, sizeof(point),
+                     "\"cut\":%llu,\"torn\":%s,\"log_bytes\":%llu,\"lost_bytes\":%llu,\"transactions\":%u",
+                     (unsigned long long)at, torn ? "true" : "false", (unsigned long long)(at - jh.tail),
+                     (unsigned long long)(jh.head - at), commits);
+            /* The cut right after each commit record: one line per transaction count */
+            int print = !torn && (i == nrecs || (i > 0 && recs[i].commits != recs[i - 1].commits));
+            recover(&ph, &cut, &want, jh.tail_txid + commits, point, print);
+        }
+    }
+
+    snprintf(fields, sizeof(fields), "\"records\":%u,\"transactions\":%u,\"log_bytes\":%llu",
+             nrecs, jh.head_txid - jh.tail_txid, (unsigned long long)(jh.head - jh.tail));
+    print_summary(&ph, fields);
+    free(ph.recovery_us);
+    free(recs);
+    free(cut.data);
+    free(want.data);
+    return ph.failures;
+}
+
+/*
+ * Stops an install after each of its home-location writes. Install writes
+ * blocks in ascending order and the superblock last, then the header, so
+ * a crash leaves some prefix of the changed blocks written and the log
+ * still full; running install again must finish the job.
+ */
+static uint32_t crash_install(const struct image *work) {
+    struct image done = { NULL, 0 };
+    struct image cut = { NULL, 0 };
+    struct phase ph = { "install", 0, 0, NULL };
+    struct journal_header jh = header_of(work);
+    char point[96];
+    char fields[96];
+    uint32_t *changed;
+    uint32_t nchanged = 0;
+
+    store_image(work);
+    if (journal("install", NULL, NULL, NULL) != 0) {
+        fprintf(stderr, "journal install failed\n");
+        exit(EXIT_FAILURE);
+    }
+    load_image(&done);
+    uint32_t txid = header_of(&done).tail_txid;
+
+    changed = malloc(((size_t)sb.total_blocks + 1) * sizeof(uint32_t));
+    ph.recovery_us = malloc(((size_t)sb.total_blocks + 2) * sizeof(double));
+    if (!changed || !ph.recovery_us) {
+        die("malloc");
+    }
+    for (uint32_t blk = 1; blk < sb.total_blocks; ++blk) {
+        size_t off = (size_t)blk * BLOCK_SIZE;
+        if (!in_journal(blk) && memcmp(work->data + off, done.data + off, BLOCK_SIZE) != 0) {
+            changed[nchanged++] = blk;
+        }
+    }
+    if (memcmp(work->data, done.data, BLOCK_SIZE) != 0) {
+        changed[nchanged++] = 0;
+    }
+
+    copy_image(&cut, work);
+    for (uint32_t k = 0; k <= nchanged; ++k) {
+        if (k > 0) {
+            size_t off = (size_t)changed[k - 1] * BLOCK_SIZE;
+            memcpy(cut.data + off, done.data + off, BLOCK_SIZE);
+        }
+        snprintf(point, sizeof(point), "\"blocks_written\":%u,\"blocks_left\":%u", k, nchanged - k);
+        /* recover() overwrites the stored image, so cut itself stays as built */
+        recover(&ph, &cut, &done, txid, point, k == 0 || k == nchanged);
+    }
+
+    snprintf(fields, sizeof(fields), "\"changed_blocks\":%u,\"transactions\":%u,\"log_bytes\":%llu",
+             nchanged, jh.head_txid - jh.tail_txid, (unsigned long long)(jh.head - jh.tail));
+    print_summary(&ph, fields);
+    free(ph.recovery_us);
+    free(changed);
+    free(cut.data);
+    free(done.data);
+    return ph.failures;
+}
+
+static void cleanup(void) {
+    const char *names[] = { IMAGE_NAME, MANIFEST_NAME, SOURCE_NAME };
+    char path[PATH_MAX];
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        work_path(path, sizeof(path), names[i]);
+        unlink(path);
+    }
+    rmdir(cfg.workdir);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-b blocks] [-i inodes] [-j journal_blocks] [-n creates] [-w writes]\n"
+                    "       [-z write_bytes] [-s none|commit|group|async] [-D ordered|journal] [-v]\n"
+                    "       [-t tool_dir] [-d work_dir]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    struct image before = { NULL, 0 };
+    struct image work = { NULL, 0 };
+    const char *tools = ".";
+    const char *workdir = NULL;
+    uint32_t failures;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:i:j:n:w:z:s:D:vt:d:")) != -1) {
+        switch (opt) {
+        case 'b':
+            cfg.blocks = optarg;
+            break;
+        case 'i':
+            cfg.inodes = optarg;
+            break;
+        case 'j':
+            cfg.journal_blocks = optarg;
+            break;
+        case 'n':
+            cfg.creates = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            cfg.writes = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'z':
+            cfg.write_size = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            cfg.sync = optarg;
+            break;
+        case 'D':
+            if (strcmp(optarg, "ordered") != 0 && strcmp(optarg, "journal") != 0) {
+                usage(argv[0]);
+            }
+            cfg.data = optarg;
+            break;
+        case 'v':
+            cfg.verbose = 1;
+            break;
+        case 't':
+            tools = optarg;
+            break;
+        case 'd':
+            workdir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || cfg.creates == 0 || cfg.write_size == 0) {
+        usage(argv[0]);
+    }
+    if (cfg.creates > MAX_ROOT_FILES) {
+        fprintf(stderr, "at most %u creates fit in the root directory\n", MAX_ROOT_FILES);
+        return EXIT_FAILURE;
+    }
+    if (!realpath(tools, cfg.tools)) {
+        die("tool directory");
+    }
+    if (workdir) {
+        if (!realpath(workdir, cfg.workdir)) {
+            die("work directory");
+        }
+    } else {
+        strcpy(cfg.workdir, "/tmp/vsfs-crash.XXXXXX");
+        if (!mkdtemp(cfg.workdir)) {
+            die("mkdtemp");
+        }
+    }
+
+    make_image();
+    load_image(&before);
+    memcpy(&sb, before.data, sizeof(sb));
+    if (sb.magic != FS_MAGIC || sb.block_size != BLOCK_SIZE) {
+        fprintf(stderr, "mkfs made an image this harness cannot read\n");
+        return EXIT_FAILURE;
+    }
+    warm_up();
+    load_image(&before);
+    workload();
+    load_image(&work);
+
+    failures = crash_append(&before, &work);
+    failures += crash_install(&work);
+
+    free(before.data);
+    free(work.data);
+    if (!workdir && failures == 0) {
+        cleanup();
+    } else if (failures > 0) {
+        fprintf(stderr, "%u crash point(s) failed; the work directory %s is kept\n", failures, cfg.workdir);
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,115 @@
+/*
+ * crc32c.h - CRC32C (Castagnoli) checksums for journal transactions
+ *
+ * Uses the SSE4.2 crc32 instruction on x86-64 and the ARMv8 CRC32
+ * extension on AArch64 when the CPU has them, eight bytes per
+ * instruction, and a byte-at-a-time table otherwise. All three give the
+ * same result. Like zlib's crc32(), the running value starts at 0 and can
+ * be fed back in to checksum data in pieces.
+ */
+#ifndef VSFS_CRC32C_H
+#define VSFS_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define CRC32C_X86 1
+#elif defined(__aarch64__) && defined(__GNUC__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#define CRC32C_ARM 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78U     /* reflected Castagnoli polynomial */
+
+/* Filled before main runs (see crc32c_init), so threads only ever read it */
+static uint32_t crc32c_table[256];
+
+static inline uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len-- > 0) {
+        crc = crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        c = _mm_crc32_u64(c, w);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c;
+    while (len-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+
+static inline int crc32c_have_hw(void) {
+    return __builtin_cpu_supports("sse4.2");
+}
+#endif
+
+#ifdef CRC32C_ARM
+__attribute__((target("+crc")))
+static inline uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        crc = __crc32cd(crc, w);
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+
+static inline int crc32c_have_hw(void) {
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+static int crc32c_use_hw;
+
+/* Builds the table and checks the CPU once, before any thread starts */
+__attribute__((constructor)) static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) {
+            c = (c >> 1) ^ ((c & 1) ? CRC32C_POLY : 0);
+        }
+        crc32c_table[i] = c;
+    }
+#if defined(CRC32C_X86)
+    __builtin_cpu_init();
+#endif
+#if defined(CRC32C_X86) || defined(CRC32C_ARM)
+    crc32c_use_hw = crc32c_have_hw() ? 1 : 0;
+#endif
+}
+
+/* Extends crc (0 to start) with len bytes of buf */
+static inline uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    crc = ~crc;
+#if defined(CRC32C_X86) || defined(CRC32C_ARM)
+    if (crc32c_use_hw) {
+        return ~crc32c_hw(crc, buf, len);
+    }
+#endif
+    return ~crc32c_sw(crc, buf, len);
+}
+
+#endif
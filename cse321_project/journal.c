@@ -1,46 +1,57 @@
+#define _GNU_SOURCE         /* O_DIRECT */
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
-#define BLOCK_SIZE      4096
-#define JOURNAL_BLOCKS  16
-#define MAX_INODES      64
-#define INODES_PER_BLOCK 32
-#define MAX_DIRENTS     128
-
-#define SUPERBLOCK_MAGIC  0x56534653
-#define JOURNAL_MAGIC     0x4A524E4C
+#include "bitmap.h"
+#include "blockdev.h"
+#include "bufpool.h"
+#include "crc32c.h"
+#include "vsfs.h"
 
 #define REC_DATA    1
 #define REC_COMMIT  2
-
-#define INODE_FILE  1
+#define REC_DELTA   3
+#define REC_PAD     4
 
 #define TRUE  1
 #define FALSE 0
 
 #define DISK_IMAGE  "vsfs.img"
+#define DIRTY_MANIFEST DISK_IMAGE ".dirty"
+#define SOCKET_PATH "vsfs.sock"
 
-struct superblock {
-    uint32_t magic;
-    uint32_t block_size;
-    uint32_t total_blocks;
-    uint32_t inode_count;
-    uint32_t journal_block;
-    uint32_t inode_bitmap;
-    uint32_t data_bitmap;
-    uint32_t inode_start;
-    uint32_t data_start;
-    uint8_t _pad[BLOCK_SIZE - 9 * 4];
-};
+/* Durability modes for --sync */
+#define SYNC_NONE   0
+#define SYNC_COMMIT 1
+#define SYNC_GROUP  2
+#define SYNC_ASYNC  3       /* one barrier per commit; replay trusts the checksum */
 
-struct journal_header {
-    uint32_t magic;
-    uint32_t nbytes_used;
-};
+/* File data handling for --data */
+#define DATA_ORDERED 0      /* data written in place before the metadata commits */
+#define DATA_JOURNAL 1      /* data logged in the transaction with the metadata */
+
+#define MAX_FILE_SIZE (256U << 20)     /* write reads the whole source into memory */
 
+#define DIRECT_BATCH 64     /* pool blocks per O_DIRECT journal write */
+
+/*
+ * Records follow the journal header (vsfs.h). A transaction never wraps:
+ * when it does not fit before the end of the area, a REC_PAD record (or
+ * the few leftover bytes) skips to the start.
+ */
 struct rec_header {
     uint16_t type;
     uint16_t size;
@@ -52,400 +63,4465 @@ struct data_record {
     uint8_t data[BLOCK_SIZE];
 };
 
+/* Byte range of one block; the payload is padded to a 4-byte boundary. */
+struct delta_record {
+    struct rec_header hdr;
+    uint32_t block_no;
+    uint16_t offset;
+    uint16_t length;
+    uint8_t data[];
+};
+
+/*
+ * Closes a transaction. crc is the CRC32C of its records up to and
+ * including txid, so a torn write anywhere in the transaction, or a stale
+ * commit left from an earlier pass over the log, fails to verify.
+ */
 struct commit_record {
     struct rec_header hdr;
+    uint32_t txid;
+    uint32_t crc;
 };
 
-struct dirent {
-    uint32_t inode;
-    char name[28];
+/*
+ * Head of an export stream. Journal records follow (REC_DATA and
+ * REC_DELTA) that bring an image from transaction from_txid to end_txid,
+ * closed by one commit record for end_txid whose crc covers the header
+ * and every record. It only applies to an image with the same layout.
+ */
+struct stream_header {
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t from_txid;
+    uint32_t end_txid;
+    struct superblock layout;
 };
 
-struct inode {
-    uint16_t type;
-    uint16_t links;
-    uint32_t size;
-    uint32_t direct[8];
-    uint32_t ctime;
-    uint32_t mtime;
-    uint8_t _pad[80];
+#define STREAM_MAGIC 0x56535831U   /* "VSX1" */
+
+/* Record sizes and delta offsets are 16 bits, so a whole block must fit in one */
+#if VSFS_BLOCK_SIZE > 32768
+#error "journal records cannot hold blocks over 32 KiB; build with VSFS_BLOCK_SIZE=1024 or 4096"
+#endif
+
+/* Records of one transaction, built in memory before touching the journal */
+struct txn_buffer {
+    uint8_t *data;
+    uint32_t len;
+    uint32_t cap;
+};
+
+/*
+ * A metadata block loaded by a transaction: its original and updated copy.
+ * Creates running in parallel in the server change data only under lock,
+ * and orig only while holding the commit lock.
+ */
+struct cached_block {
+    uint32_t block_no;
+    pthread_mutex_t lock;
+    uint32_t log_pass;      /* last log_changes() pass that logged it */
+    int touched;            /* on the touched list: data may differ from orig */
+    int used;               /* looked up since the last cache_trim() sweep */
+    uint8_t orig[BLOCK_SIZE];
+    uint8_t data[BLOCK_SIZE];
+};
+
+/*
+ * Metadata blocks loaded by the transactions being built, indexed by block
+ * number. Blocks handed out for changing go on the touched list, so a
+ * commit or a revert only looks at those; the others are clean and may be
+ * evicted between commands.
+ */
+struct block_cache {
+    struct cached_block **blocks;
+    int count;
+    int cap;
+    int *index;             /* open addressing: blocks[] position + 1, 0 = empty */
+    int index_cap;
+    struct cached_block **touched;
+    int ntouched;           /* touched[] has room for cap blocks */
+    struct journal_header *jh;
+    pthread_rwlock_t lock;  /* guards blocks[]: lookups share it, loads take it alone */
+    pthread_mutex_t touch_lock;
+};
+
+#define CACHE_MAX_BLOCKS 1024   /* clean blocks the server keeps between commands */
+#define OVERLAY_MAX_BLOCKS 4096 /* overlay images kept after checkpoints installed them */
+
+#define CHANGE_BYTES  1     /* bytes only this transaction writes: logged as they are now */
+#define CHANGE_ZERO   2     /* a range this transaction cleared */
+#define CHANGE_BITS   3     /* bitmap bits it set in one byte */
+#define CHANGE_MAX    4     /* a 32-bit size it raised to at least value */
+#define CHANGE_COMMIT 5     /* ends a transaction */
+
+/*
+ * One change a create made to a cached block. A create logs its own
+ * changes applied to the last logged copy rather than the difference
+ * between the copies, so it never logs what a create still being built
+ * next to it changed in the same block.
+ */
+struct txn_change {
+    struct cached_block *cb;
+    uint16_t offset;
+    uint16_t length;
+    uint8_t kind;
+    uint32_t value;         /* the bits for CHANGE_BITS, the size for CHANGE_MAX */
+};
+
+struct txn_changes {
+    struct txn_change *list;
+    int count;
+    int cap;
 };
 
-FILE *disk = NULL;
+/*
+ * Hash index over the root directory's entries, built from the directory
+ * blocks the first time a create needs it. Entries are numbered across
+ * the direct[] blocks (entry e lives in block e / DIRENTS_PER_BLOCK).
+ */
+struct dir_index {
+    uint32_t *slots;        /* open addressing: entry number + 1, 0 = empty */
+    uint32_t *hashes;       /* name hash of the entry in each slot */
+    uint32_t slot_cap;
+    uint32_t used;
+    uint32_t *free;         /* free entry numbers, lowest on top */
+    uint32_t nfree;
+    int highest;            /* last entry in use: the directory's high-water mark */
+    int built;
+};
+
+/* One home-location write collected while replaying the log */
+struct replay_write {
+    uint32_t block_no;
+    const uint8_t *data;    /* the image to write: journal area or scratch */
+    uint8_t *scratch;       /* private copy, once a delta patched the block */
+};
+
+/* Writes of the transaction being replayed, indexed by block number */
+struct replay_set {
+    struct replay_write *writes;
+    int count;
+    int cap;
+    int *index;             /* open addressing: writes[] position + 1, 0 = empty */
+    int index_cap;
+};
+
+#define LOG_START   ((uint32_t)sizeof(struct journal_header))
+
+/*
+ * Dirty-block manifest: every home-location write made by install or a
+ * checkpoint appends one extent per changed byte run, followed by the
+ * bytes it overwrote. validator --incremental reads it to recheck only
+ * what changed, and empties it after a clean run.
+ */
+struct dirty_extent {
+    uint32_t block_no;
+    uint16_t offset;
+    uint16_t length;        /* old bytes that follow the extent */
+};
+
+#define DIRTY_GAP 8         /* equal bytes worth merging into one extent */
+
+/*
+ * Counters for --stats. Server threads update them at the same time, so
+ * every update is an atomic add (or compare-and-swap, for the maxima);
+ * without --stats they cost one branch.
+ */
+struct journal_stats {
+    uint64_t blocks_read;               /* outside the journal area */
+    uint64_t blocks_written;
+    uint64_t journal_bytes_appended;    /* records placed in the log */
+    uint64_t journal_bytes_written;     /* every journal write, headers included */
+    uint64_t transactions_committed;
+    uint64_t fsyncs;
+    uint64_t fsync_ns;
+    uint64_t fsync_max_ns;
+    uint64_t transactions_installed;
+    uint64_t records_replayed;
+    uint64_t records_discarded;         /* uncommitted or torn */
+    uint64_t blocks_installed;
+    uint64_t allocations;
+    uint64_t alloc_bits_scanned;        /* bitmap bits looked at to find the free ones */
+    uint64_t alloc_max_scan;
+};
+
+#define STAT_ADD(field, n) \
+    do { if (show_stats) __atomic_fetch_add(&stats.field, (uint64_t)(n), __ATOMIC_RELAXED); } while (0)
+
+struct blockdev disk = { -1, NULL, 0, 0, 0, NULL, -1 };
+struct buf_pool block_pool = BUF_POOL_INIT(BLOCK_SIZE);    /* replay copies, --direct writes */
 struct superblock sb;
+int sync_mode = SYNC_COMMIT;
+int data_mode = DATA_ORDERED;
+int serving = FALSE;        /* running as a server: no stdin, cache kept */
+const char *connect_path = NULL;
+volatile sig_atomic_t stop_serving = 0;
+int show_stats = FALSE;
+struct journal_stats stats;
+uint64_t start_ns;
+
+/*
+ * Metadata blocks as of the last logged transaction, and the root
+ * directory index over them. A one-shot command fills them once; the
+ * server keeps them across requests. Every change ends up either logged
+ * or reverted (cache_settle, or by the create that failed), so they always
+ * match the journal.
+ */
+struct block_cache meta_cache = { NULL, 0, 0, NULL, 0, NULL, 0, NULL,
+                                   PTHREAD_RWLOCK_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
+struct dir_index meta_dir;
+pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;  /* meta_dir and the root's entries */
+volatile sig_atomic_t meta_stale = 0;  /* a commit failed in the server: drop the cache */
+
+/*
+ * Newest committed image of every block the log holds, each in a private
+ * copy, covering the records up to overlay_head. See overlay_sync().
+ */
+struct replay_set overlay = { NULL, 0, 0, NULL, 0 };
+uint64_t overlay_tail = 0;  /* tail the overlay was built from */
+uint64_t overlay_head = 0;
+uint32_t overlay_txid = 0;  /* txid of the transaction at overlay_head */
+int overlay_valid = FALSE;
+int io_flags = BDEV_WRITE | BDEV_MMAP;
+pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;  /* the journal lock's holder thread */
+
+/* Each server thread answers its own client */
+__thread FILE *output;      /* where commands print: stdout, or the client */
+__thread int journal_locks = 0;     /* nesting depth of lock_journal() */
+__thread FILE *attempt_out = NULL;  /* holds output while a transaction is being built */
+__thread FILE *attempt_saved = NULL;
+__thread char *attempt_buf = NULL;
+__thread size_t attempt_len = 0;
+__thread uint32_t inode_hint = 1;   /* where the next inode search starts */
+__thread uint32_t data_hint = 0;    /* where the next data block search starts */
+
+#define MAX_CLIENTS   64
+#define ALLOC_REGIONS 8     /* parts of each bitmap server threads start allocating in */
+
+struct alloc_hints {
+    uint32_t inode;
+    uint32_t data;
+    int set;
+};
+
+pthread_rwlock_t command_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t client_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t client_done = PTHREAD_COND_INITIALIZER;
+int client_fds[MAX_CLIENTS];        /* socket + 1 of each client thread, 0 = free slot */
+struct alloc_hints client_hints[MAX_CLIENTS];
+int clients = 0;
+int listen_fd = -1;
+
+int checkpoint_journal(struct journal_header *jh, int max_transactions, int *uncommitted);
+void cache_drop(struct block_cache *cache, struct dir_index *dir);
+int read_block_logged(struct journal_header *jh, uint32_t block_no, uint8_t *buffer);
+int block_in_journal(struct journal_header *jh, uint32_t block_no);
+void replay_free(struct replay_set *set);
+int lock_journal(void);
+void unlock_journal(void);
+int finish_resize(int report);
+int install_pending(struct journal_header *jh, int *installed);
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void stat_max(uint64_t *field, uint64_t value) {
+    uint64_t seen = __atomic_load_n(field, __ATOMIC_RELAXED);
+    
+    while (value > seen &&
+           !__atomic_compare_exchange_n(field, &seen, value, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/* One JSON object with every counter, for --stats and the server's stats command */
+void print_stats(FILE *out, const char *command) {
+    struct journal_stats s;
+    
+    memcpy(&s, &stats, sizeof(s));
+    fprintf(out, "{\"tool\":\"journal\",\"command\":\"%s\",\"elapsed_ms\":%.3f,"
+                 "\"blocks_read\":%llu,\"blocks_written\":%llu,"
+                 "\"journal_bytes_appended\":%llu,\"journal_bytes_written\":%llu,"
+                 "\"transactions_committed\":%llu,\"fsyncs\":%llu,\"fsync_ms\":%.3f,\"fsync_max_us\":%.1f,"
+                 "\"transactions_installed\":%llu,\"records_replayed\":%llu,\"records_discarded\":%llu,"
+                 "\"blocks_installed\":%llu,\"allocations\":%llu,\"alloc_bits_scanned\":%llu,"
+                 "\"alloc_max_scan\":%llu}\n",
+            command, (now_ns() - start_ns) / 1e6,
+            (unsigned long long)s.blocks_read, (unsigned long long)s.blocks_written,
+            (unsigned long long)s.journal_bytes_appended, (unsigned long long)s.journal_bytes_written,
+            (unsigned long long)s.transactions_committed, (unsigned long long)s.fsyncs,
+            s.fsync_ns / 1e6, s.fsync_max_ns / 1e3,
+            (unsigned long long)s.transactions_installed, (unsigned long long)s.records_replayed,
+            (unsigned long long)s.records_discarded, (unsigned long long)s.blocks_installed,
+            (unsigned long long)s.allocations, (unsigned long long)s.alloc_bits_scanned,
+            (unsigned long long)s.alloc_max_scan);
+}
 
 int read_block(uint32_t block_no, void *buffer) {
-    fseek(disk, block_no * BLOCK_SIZE, SEEK_SET);
-    if (fread(buffer, BLOCK_SIZE, 1, disk) != 1) {
+    if (bdev_read(&disk, block_no, buffer) < 0) {
         return FALSE;
     }
+    STAT_ADD(blocks_read, 1);
     return TRUE;
 }
 
-int write_block(uint32_t block_no, void *buffer) {
-    fseek(disk, block_no * BLOCK_SIZE, SEEK_SET);
-    if (fwrite(buffer, BLOCK_SIZE, 1, disk) != 1) {
+int write_block(uint32_t block_no, const void *buffer) {
+    if (bdev_write(&disk, block_no, buffer) < 0) {
         return FALSE;
     }
-    fflush(disk);
+    STAT_ADD(blocks_written, 1);
     return TRUE;
 }
 
-int read_journal(uint32_t offset, void *buffer, uint32_t size) {
-    uint32_t pos = sb.journal_block * BLOCK_SIZE + offset;
-    fseek(disk, pos, SEEK_SET);
-    if (fread(buffer, size, 1, disk) != 1) {
+/* Writes count consecutive blocks from buffer in one call */
+int write_blocks(uint32_t block_no, const void *buffer, uint32_t count) {
+    if (bdev_pwrite(&disk, (uint64_t)block_no * BLOCK_SIZE, buffer, (uint64_t)count * BLOCK_SIZE) < 0) {
         return FALSE;
     }
+    STAT_ADD(blocks_written, count);
     return TRUE;
 }
 
-int write_journal(uint32_t offset, void *buffer, uint32_t size) {
-    uint32_t pos = sb.journal_block * BLOCK_SIZE + offset;
-    fseek(disk, pos, SEEK_SET);
-    if (fwrite(buffer, size, 1, disk) != 1) {
-        return FALSE;
+/*
+ * --direct: reads the aligned range around the bytes into pool blocks
+ * past the page cache and copies the bytes out.
+ */
+int read_direct(uint64_t pos, uint8_t *data, uint32_t size) {
+    struct iovec iov[DIRECT_BATCH];
+    uint64_t end = pos + size;
+    uint64_t block = pos & ~(uint64_t)(BLOCK_SIZE - 1);
+    uint64_t from, to, b;
+    int ok = TRUE;
+    int n, i;
+    
+    while (block < end && ok) {
+        n = 0;
+        while (n < DIRECT_BATCH && block + (uint64_t)n * BLOCK_SIZE < end) {
+            iov[n].iov_base = pool_get(&block_pool);
+            if (iov[n].iov_base == NULL) {
+                ok = FALSE;
+                break;
+            }
+            iov[n].iov_len = BLOCK_SIZE;
+            n++;
+        }
+        if (ok && bdev_direct_io(&disk, FALSE, block, iov, n) < 0) {
+            ok = FALSE;
+        }
+        for (i = 0; i < n; i++) {
+            b = block + (uint64_t)i * BLOCK_SIZE;
+            from = (b > pos) ? b : pos;
+            to = (b + BLOCK_SIZE < end) ? b + BLOCK_SIZE : end;
+            if (ok) {
+                memcpy(data + (from - pos), (uint8_t *)iov[i].iov_base + (from - b), to - from);
+            }
+            pool_put(&block_pool, iov[i].iov_base);
+        }
+        block += (uint64_t)n * BLOCK_SIZE;
     }
-    fflush(disk);
-    return TRUE;
+    return ok;
 }
 
-int open_disk(void) {
-    disk = fopen(DISK_IMAGE, "r+b");
-    if (disk == NULL) {
-        printf("Error: Cannot open %s\n", DISK_IMAGE);
-        return FALSE;
+int read_journal(uint32_t offset, void *buffer, uint32_t size) {
+    uint64_t pos = (uint64_t)sb.journal_block * BLOCK_SIZE + offset;
+    if (disk.direct_fd >= 0) {
+        return read_direct(pos, buffer, size);
     }
-    
-    read_block(0, &sb);
-    
-    if (sb.magic != SUPERBLOCK_MAGIC) {
-        printf("Error: Invalid filesystem\n");
-        fclose(disk);
+    if (bdev_pread(&disk, pos, buffer, size) < 0) {
         return FALSE;
     }
     return TRUE;
 }
 
-void close_disk(void) {
-    if (disk != NULL) {
-        fclose(disk);
-        disk = NULL;
+/*
+ * --direct: copies the bytes into pool blocks covering the aligned range
+ * around them and writes those past the page cache. A block the bytes
+ * only partly cover is read first, so the rest of it survives.
+ */
+int write_direct(uint64_t pos, const uint8_t *data, uint32_t size) {
+    struct iovec iov[DIRECT_BATCH];
+    uint64_t end = pos + size;
+    uint64_t block = pos & ~(uint64_t)(BLOCK_SIZE - 1);
+    uint64_t from, to, b;
+    int ok = TRUE;
+    int n, i;
+    
+    while (block < end && ok) {
+        n = 0;
+        while (n < DIRECT_BATCH && block + (uint64_t)n * BLOCK_SIZE < end) {
+            iov[n].iov_base = pool_get(&block_pool);
+            if (iov[n].iov_base == NULL) {
+                ok = FALSE;
+                break;
+            }
+            iov[n].iov_len = BLOCK_SIZE;
+            n++;
+        }
+        for (i = 0; i < n && ok; i++) {
+            b = block + (uint64_t)i * BLOCK_SIZE;
+            from = (b > pos) ? b : pos;
+            to = (b + BLOCK_SIZE < end) ? b + BLOCK_SIZE : end;
+            if ((from > b || to < b + BLOCK_SIZE) &&
+                bdev_direct_io(&disk, FALSE, b, &iov[i], 1) < 0) {
+                ok = FALSE;
+                break;
+            }
+            memcpy((uint8_t *)iov[i].iov_base + (from - b), data + (from - pos), to - from);
+        }
+        if (ok && bdev_direct_io(&disk, TRUE, block, iov, n) < 0) {
+            ok = FALSE;
+        }
+        for (i = 0; i < n; i++) {
+            pool_put(&block_pool, iov[i].iov_base);
+        }
+        block += (uint64_t)n * BLOCK_SIZE;
     }
+    return ok;
 }
 
-int find_free_inode(uint8_t *bitmap) {
-    int i, j;
-    for (i = 0; i < MAX_INODES / 8; i++) {
-        if (bitmap[i] == 0xFF) continue;
-        for (j = 0; j < 8; j++) {
-            int idx = i * 8 + j;
-            if (idx == 0) continue;
-            if ((bitmap[i] & (1 << j)) == 0) {
-                return idx;
-            }
-        }
+int write_journal(uint32_t offset, const void *buffer, uint32_t size) {
+    uint64_t pos = (uint64_t)sb.journal_block * BLOCK_SIZE + offset;
+    STAT_ADD(journal_bytes_written, size);
+    if (disk.direct_fd >= 0) {
+        return write_direct(pos, buffer, size);
     }
-    return -1;
+    if (bdev_pwrite(&disk, pos, buffer, size) < 0) {
+        return FALSE;
+    }
+    return TRUE;
 }
 
-void set_bit(uint8_t *bitmap, int idx) {
-    bitmap[idx / 8] |= (1 << (idx % 8));
+uint32_t journal_size(void) {
+    return vsfs_journal_blocks(&sb) * BLOCK_SIZE;
 }
 
-int find_free_dirent(struct dirent *dirents, const char *filename, int *slot) {
-    int i;
-    int found_slot = FALSE;
-    *slot = -1;
+/*
+ * Returns the whole journal area: a pointer into the mapping, or a buffer
+ * read with pread (or past the page cache with --direct) that the caller
+ * releases with free(*to_free).
+ */
+const uint8_t *get_journal_area(uint8_t **to_free) {
+    uint64_t pos = (uint64_t)sb.journal_block * BLOCK_SIZE;
+    const uint8_t *area;
+    struct iovec iov;
     
-    for (i = 0; i < MAX_DIRENTS; i++) {
-        if (dirents[i].name[0] != '\0') {
-            if (strcmp(dirents[i].name, filename) == 0) {
-                return -1;
-            }
-        } else {
-            if (found_slot == FALSE) {
-                *slot = i;
-                found_slot = TRUE;
-            }
+    *to_free = NULL;
+    if (disk.direct_fd >= 0) {
+        if (posix_memalign((void **)to_free, BDEV_DIRECT_ALIGN, journal_size()) != 0) {
+            *to_free = NULL;
+            fprintf(output, "Error: Cannot allocate memory\n");
+            return NULL;
         }
+        iov.iov_base = *to_free;
+        iov.iov_len = journal_size();
+        if (bdev_direct_io(&disk, FALSE, pos, &iov, 1) < 0) {
+            fprintf(output, "Error: Cannot read journal\n");
+            free(*to_free);
+            *to_free = NULL;
+            return NULL;
+        }
+        return *to_free;
     }
-    return found_slot ? 0 : -2;
-}
-
-int get_highest_dirent(struct dirent *dirents) {
-    int i;
-    int highest = -1;
-    for (i = 0; i < MAX_DIRENTS; i++) {
-        if (dirents[i].name[0] != '\0') {
-            highest = i;
+    if (disk.map == NULL) {
+        *to_free = malloc(journal_size());
+        if (*to_free == NULL) {
+            fprintf(output, "Error: Cannot allocate memory\n");
+            return NULL;
         }
     }
-    return highest;
+    area = bdev_get(&disk, pos, *to_free, journal_size());
+    if (area == NULL) {
+        fprintf(output, "Error: Cannot read journal\n");
+        free(*to_free);
+        *to_free = NULL;
+    }
+    return area;
 }
 
-int journal_create(const char *filename) {
-    struct journal_header jh;
-    uint8_t inode_bitmap[BLOCK_SIZE];
-    uint8_t inode_block0[BLOCK_SIZE];
-    uint8_t inode_block1[BLOCK_SIZE];
-    uint8_t dir_block[BLOCK_SIZE];
-    struct inode *inodes0;
-    struct inode *inodes1;
-    struct dirent *dirents;
-    struct data_record data_rec;
-    struct commit_record commit_rec;
-    
-    int free_inode;
-    int free_slot;
-    int in_block1;
-    int result;
-    uint32_t offset;
-    uint32_t root_dir_block;
-    uint32_t current_time;
-    uint32_t space_needed;
-    uint32_t space_available;
-    int i;
-    int highest;
+/* Write barrier: everything written so far is durable before what follows */
+int barrier(void) {
+    uint64_t start;
+    int rc;
     
-    if (strlen(filename) > 27) {
-        printf("Error: Filename too long (max 27 characters)\n");
+    if (sync_mode == SYNC_NONE) {
+        return TRUE;
+    }
+    if (show_stats) {
+        start = now_ns();
+        rc = bdev_sync(&disk);
+        start = now_ns() - start;
+        STAT_ADD(fsyncs, 1);
+        STAT_ADD(fsync_ns, start);
+        stat_max(&stats.fsync_max_ns, start);
+    } else {
+        rc = bdev_sync(&disk);
+    }
+    if (rc != 0) {
+        fprintf(output, "Error: fdatasync failed\n");
         return FALSE;
     }
-    
-    read_journal(0, &jh, sizeof(jh));
-    
-    if (jh.magic != JOURNAL_MAGIC) {
-        jh.magic = JOURNAL_MAGIC;
-        jh.nbytes_used = sizeof(struct journal_header);
+    return TRUE;
+}
+
+uint32_t journal_capacity(void) {
+    return journal_size() - LOG_START;
+}
+
+uint32_t log_offset(uint64_t pos) {
+    return LOG_START + (uint32_t)(pos % journal_capacity());
+}
+
+/*
+ * Returns FALSE when the journal has never been written, and -1, with the
+ * error printed, when the header could not be read.
+ */
+int read_journal_header(struct journal_header *jh) {
+    if (read_journal(0, jh, sizeof(*jh)) == FALSE) {
+        fprintf(output, "Error: Cannot read the journal header\n");
+        return -1;
     }
     
-    space_available = JOURNAL_BLOCKS * BLOCK_SIZE;
-    space_needed = 4 * sizeof(struct data_record) + sizeof(struct commit_record);
-    
-    if (jh.nbytes_used + space_needed > space_available) {
-        printf("Error: Journal is full. Please run './journal install' first.\n");
+    if (jh->magic != JOURNAL_MAGIC) {
+        jh->magic = JOURNAL_MAGIC;
+        jh->flags = 0;
+        jh->head = 0;
+        jh->tail = 0;
+        jh->head_txid = 0;
+        jh->tail_txid = 0;
         return FALSE;
     }
+    if (jh->head < jh->tail || jh->head - jh->tail > journal_capacity()) {
+        fprintf(output, "Warning: Journal header is corrupt, resetting journal\n");
+        jh->head = 0;
+        jh->tail = 0;
+        jh->tail_txid = jh->head_txid;
+    }
+    return TRUE;
+}
+
+/*
+ * Returns the record at *pos in a copy of the whole journal area, after
+ * skipping any padding at the end of the area, or NULL when the log ends
+ * or the record is malformed. *pos is left at the returned record.
+ */
+const struct rec_header *next_record(const uint8_t *journal_data, uint64_t *pos, uint64_t head) {
+    const struct rec_header *rec;
+    uint32_t offset;
+    uint32_t room;
     
-    read_block(sb.inode_bitmap, inode_bitmap);
+    while (*pos < head) {
+        offset = log_offset(*pos);
+        room = journal_capacity() - (offset - LOG_START);
+        rec = (const struct rec_header *)(journal_data + offset);
+        
+        if (room < sizeof(struct rec_header) || rec->type == REC_PAD) {
+            *pos += room;
+            continue;
+        }
+        if (rec->size < sizeof(struct rec_header)) return NULL;
+        if (rec->size > room || *pos + rec->size > head) return NULL;
+        if (rec->type == REC_DELTA) {
+            const struct delta_record *delta_rec = (const struct delta_record *)rec;
+            if (delta_rec->offset + delta_rec->length > BLOCK_SIZE) return NULL;
+        } else if (rec->type != REC_DATA && rec->type != REC_COMMIT) {
+            return NULL;
+        }
+        return rec;
+    }
+    return NULL;
+}
+
+/*
+ * Checks the transaction at *pos: its records must end in a commit record
+ * for txid whose checksum matches. On success *pos is moved to its first
+ * record, past any padding, and *end past its commit record. Otherwise
+ * *records is set to the number of records seen before the check failed
+ * (when records is not NULL).
+ */
+int verify_transaction(const uint8_t *journal_data, uint64_t *pos, uint64_t head,
+                       uint32_t txid, uint64_t *end, int *records) {
+    const struct rec_header *rec;
+    const struct commit_record *commit;
+    uint64_t next;
+    uint32_t crc = 0;
+    int seen = 0;
     
-    free_inode = find_free_inode(inode_bitmap);
-    if (free_inode == -1) {
-        printf("Error: No free inodes available\n");
+    if (records != NULL) {
+        *records = 0;
+    }
+    if (next_record(journal_data, pos, head) == NULL) {
         return FALSE;
     }
     
-    in_block1 = (free_inode >= INODES_PER_BLOCK) ? TRUE : FALSE;
+    next = *pos;
+    while ((rec = next_record(journal_data, &next, head)) != NULL) {
+        if (rec->type == REC_COMMIT) {
+            commit = (const struct commit_record *)rec;
+            crc = crc32c(crc, rec, offsetof(struct commit_record, crc));
+            if (rec->size != sizeof(struct commit_record) || commit->txid != txid || commit->crc != crc) {
+                break;
+            }
+            *end = next + rec->size;
+            return TRUE;
+        }
+        crc = crc32c(crc, rec, rec->size);
+        seen++;
+        next += rec->size;
+    }
+    if (records != NULL) {
+        *records = seen;
+    }
+    return FALSE;
+}
+
+/*
+ * Commit lock: an fcntl write lock on the journal header. Any number of
+ * journal processes build transactions at once; only appending to the
+ * log (claiming the range at head and the next txid), checkpoints and
+ * installs hold it. Nested calls only count. Threads of the server take
+ * commit_lock first, since fcntl locks belong to the whole process.
+ */
+int lock_journal(void) {
+    struct flock fl;
     
-    read_block(sb.inode_start, inode_block0);
-    read_block(sb.inode_start + 1, inode_block1);
+    if (journal_locks++ > 0) {
+        return TRUE;
+    }
+    pthread_mutex_lock(&commit_lock);
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = (off_t)sb.journal_block * BLOCK_SIZE;
+    fl.l_len = sizeof(struct journal_header);
+    while (fcntl(disk.fd, F_SETLKW, &fl) < 0) {
+        if (errno != EINTR) {
+            fprintf(output, "Error: Cannot lock the journal\n");
+            pthread_mutex_unlock(&commit_lock);
+            journal_locks--;
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+void unlock_journal(void) {
+    struct flock fl;
     
-    inodes0 = (struct inode *)inode_block0;
-    inodes1 = (struct inode *)inode_block1;
+    if (--journal_locks > 0) {
+        return;
+    }
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_UNLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = (off_t)sb.journal_block * BLOCK_SIZE;
+    fl.l_len = sizeof(struct journal_header);
+    fcntl(disk.fd, F_SETLK, &fl);
+    pthread_mutex_unlock(&commit_lock);
+}
+
+/*
+ * Holds back what building a transaction prints until it is known to
+ * commit, so an attempt thrown away after a conflict prints nothing.
+ */
+void attempt_begin(void) {
+    fflush(output);
+    attempt_out = open_memstream(&attempt_buf, &attempt_len);
+    if (attempt_out != NULL) {
+        attempt_saved = output;
+        output = attempt_out;
+    }
+}
+
+void attempt_end(int keep) {
+    if (attempt_out == NULL) {
+        return;
+    }
+    fclose(attempt_out);
+    output = attempt_saved;
+    if (keep) {
+        fwrite(attempt_buf, 1, attempt_len, output);
+    }
+    free(attempt_buf);
+    attempt_out = NULL;
+    attempt_buf = NULL;
+    attempt_len = 0;
+}
+
+int open_disk(int exclusive) {
+    uint8_t block[BLOCK_SIZE];
+    struct journal_header jh;
     
-    root_dir_block = inodes0[0].direct[0];
-    read_block(root_dir_block, dir_block);
-    dirents = (struct dirent *)dir_block;
+    if (bdev_open(&disk, DISK_IMAGE, io_flags, BLOCK_SIZE) < 0) {
+        if ((io_flags & BDEV_DIRECT) && errno == EINVAL) {
+            fprintf(output, "Error: The file system holding %s does not support --direct\n", DISK_IMAGE);
+        } else {
+            fprintf(output, "Error: Cannot open %s\n", DISK_IMAGE);
+        }
+        return FALSE;
+    }
     
-    result = find_free_dirent(dirents, filename, &free_slot);
+    /*
+     * One-shot commands share the image and serialize their commits on
+     * the journal lock. The server's cache is only valid while nobody else
+     * changes the image, so it must be alone.
+     */
+    if (flock(disk.fd, (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB) < 0) {
+        fprintf(output, "Error: %s is in use by another journal process (use --connect if a server is running)\n",
+                DISK_IMAGE);
+        bdev_close(&disk);
+        return FALSE;
+    }
     
-    if (result == -1) {
-        printf("Error: File '%s' already exists\n", filename);
+    if (read_block(0, block) == FALSE) {
+        fprintf(output, "Error: Invalid filesystem\n");
+        bdev_close(&disk);
         return FALSE;
     }
-    if (result == -2 || free_slot == -1) {
-        printf("Error: Root directory is full\n");
+    memcpy(&sb, block, sizeof(sb));
+    if (sb.magic == FS_MAGIC && sb.block_size != BLOCK_SIZE) {
+        fprintf(output, "Error: %s has %u-byte blocks, but this journal is built for %u-byte blocks\n",
+                DISK_IMAGE, sb.block_size, BLOCK_SIZE);
+        bdev_close(&disk);
         return FALSE;
     }
-    
-    set_bit(inode_bitmap, free_inode);
-    
-    current_time = (uint32_t)time(NULL);
-    
-    if (in_block1 == TRUE) {
-        int idx = free_inode - INODES_PER_BLOCK;
-        inodes1[idx].type = INODE_FILE;
-        inodes1[idx].links = 1;
-        inodes1[idx].size = 0;
-        for (i = 0; i < 8; i++) inodes1[idx].direct[i] = 0;
-        inodes1[idx].ctime = current_time;
-        inodes1[idx].mtime = current_time;
-    } else {
-        inodes0[free_inode].type = INODE_FILE;
-        inodes0[free_inode].links = 1;
-        inodes0[free_inode].size = 0;
-        for (i = 0; i < 8; i++) inodes0[free_inode].direct[i] = 0;
-        inodes0[free_inode].ctime = current_time;
-        inodes0[free_inode].mtime = current_time;
+    if (sb.magic != FS_MAGIC || !vsfs_journal_placed(&sb) ||
+        vsfs_journal_blocks(&sb) > UINT32_MAX / BLOCK_SIZE) {
+        fprintf(output, "Error: Invalid filesystem\n");
+        bdev_close(&disk);
+        return FALSE;
     }
     
-    dirents[free_slot].inode = free_inode;
-    memset(dirents[free_slot].name, 0, 28);
-    strncpy(dirents[free_slot].name, filename, 27);
-    
-    highest = get_highest_dirent(dirents);
-    if (highest >= 0) {
-        inodes0[0].size = (highest + 1) * sizeof(struct dirent);
+    /* A resize that stopped after its commit is finished first, alone */
+    if (read_journal_header(&jh) < 0) {
+        bdev_close(&disk);
+        return FALSE;
     }
-    
-    offset = jh.nbytes_used;
-    
-    data_rec.hdr.type = REC_DATA;
-    data_rec.hdr.size = sizeof(struct data_record);
-    data_rec.block_no = sb.inode_bitmap;
-    memcpy(data_rec.data, inode_bitmap, BLOCK_SIZE);
-    write_journal(offset, &data_rec, sizeof(data_rec));
-    offset += sizeof(struct data_record);
-    
-    data_rec.block_no = sb.inode_start;
-    memcpy(data_rec.data, inode_block0, BLOCK_SIZE);
-    write_journal(offset, &data_rec, sizeof(data_rec));
-    offset += sizeof(struct data_record);
-    
-    if (in_block1 == TRUE) {
-        data_rec.block_no = sb.inode_start + 1;
-        memcpy(data_rec.data, inode_block1, BLOCK_SIZE);
-        write_journal(offset, &data_rec, sizeof(data_rec));
-        offset += sizeof(struct data_record);
+    if (jh.flags & JOURNAL_RESIZING) {
+        if (exclusive == FALSE && flock(disk.fd, LOCK_EX | LOCK_NB) < 0) {
+            fprintf(output, "Error: %s has an unfinished journal resize; run a command while no other journal process uses it\n",
+                    DISK_IMAGE);
+            bdev_close(&disk);
+            return FALSE;
+        }
+        if (finish_resize(TRUE) == FALSE) {
+            bdev_close(&disk);
+            return FALSE;
+        }
+        if (exclusive == FALSE) {
+            flock(disk.fd, LOCK_SH);
+        }
     }
-    
-    data_rec.block_no = root_dir_block;
-    memcpy(data_rec.data, dir_block, BLOCK_SIZE);
-    write_journal(offset, &data_rec, sizeof(data_rec));
-    offset += sizeof(struct data_record);
-    
-    commit_rec.hdr.type = REC_COMMIT;
-    commit_rec.hdr.size = sizeof(struct commit_record);
-    write_journal(offset, &commit_rec, sizeof(commit_rec));
-    offset += sizeof(struct commit_record);
-    
-    jh.nbytes_used = offset;
-    write_journal(0, &jh, sizeof(jh));
-    
-    printf("Success: File '%s' logged to journal (inode %d)\n", filename, free_inode);
-    printf("Run './journal install' to apply changes to disk.\n");
-    
     return TRUE;
 }
 
-int journal_install(void) {
-    struct journal_header jh;
-    uint8_t *journal_data;
-    struct rec_header *rec;
-    struct data_record *data_rec;
+void close_disk(void) {
+    cache_drop(&meta_cache, &meta_dir);
+    replay_free(&overlay);
+    overlay_valid = FALSE;
+    pool_release(&block_pool);
+    if (disk.fd >= 0) {
+        bdev_close(&disk);
+    }
+}
+
+int txn_append(struct txn_buffer *txn, const void *rec, uint32_t size) {
+    if (txn->len + size > txn->cap) {
+        uint32_t cap = txn->cap ? txn->cap : BLOCK_SIZE;
+        uint8_t *grown;
+        while (cap < txn->len + size) cap *= 2;
+        grown = realloc(txn->data, cap);
+        if (grown == NULL) {
+            return FALSE;
+        }
+        txn->data = grown;
+        txn->cap = cap;
+    }
+    memcpy(txn->data + txn->len, rec, size);
+    txn->len += size;
+    return TRUE;
+}
+
+int txn_append_delta(struct txn_buffer *txn, uint32_t block_no,
+                     const uint8_t *data, uint32_t offset, uint32_t length) {
+    uint8_t buf[sizeof(struct delta_record) + BLOCK_SIZE + 3];
+    struct delta_record *rec = (struct delta_record *)buf;
+    uint32_t size = (sizeof(struct delta_record) + length + 3) & ~3U;
     
-    uint32_t offset;
-    int transactions = 0;
-    int pending = 0;
+    memset(buf, 0, size);
+    rec->hdr.type = REC_DELTA;
+    rec->hdr.size = size;
+    rec->block_no = block_no;
+    rec->offset = offset;
+    rec->length = length;
+    memcpy(rec->data, data + offset, length);
+    return txn_append(txn, rec, size);
+}
+
+/*
+ * Logs the bytes that differ between the original and updated copy of a
+ * block as delta records. Runs closer together than a record header are
+ * merged, and a full data record is used when that would be smaller.
+ */
+int log_block(struct txn_buffer *txn, uint32_t block_no,
+              const uint8_t *orig, const uint8_t *data) {
+    struct data_record data_rec;
+    uint32_t starts[BLOCK_SIZE / 2];
+    uint32_t ends[BLOCK_SIZE / 2];
+    uint32_t total = 0;
+    int runs = 0;
     int i;
+    uint32_t pos = 0;
     
-    uint32_t write_blocks[16];
-    uint8_t *write_data[16];
+    while (pos < BLOCK_SIZE) {
+        uint32_t end;
+        if (orig[pos] == data[pos]) {
+            pos++;
+            continue;
+        }
+        end = pos + 1;
+        while (end < BLOCK_SIZE && orig[end] != data[end]) end++;
+        if (runs > 0 && pos - ends[runs - 1] <= sizeof(struct delta_record)) {
+            ends[runs - 1] = end;
+        } else {
+            starts[runs] = pos;
+            ends[runs] = end;
+            runs++;
+        }
+        pos = end;
+    }
     
-    read_journal(0, &jh, sizeof(jh));
+    for (i = 0; i < runs; i++) {
+        total += (sizeof(struct delta_record) + ends[i] - starts[i] + 3) & ~3U;
+    }
     
-    if (jh.magic != JOURNAL_MAGIC) {
-        printf("Journal is empty or uninitialized.\n");
-        return TRUE;
+    if (total >= sizeof(struct data_record)) {
+        data_rec.hdr.type = REC_DATA;
+        data_rec.hdr.size = sizeof(struct data_record);
+        data_rec.block_no = block_no;
+        memcpy(data_rec.data, data, BLOCK_SIZE);
+        return txn_append(txn, &data_rec, sizeof(data_rec));
     }
     
-    if (jh.nbytes_used <= sizeof(struct journal_header)) {
-        printf("Journal is empty. Nothing to install.\n");
-        return TRUE;
+    for (i = 0; i < runs; i++) {
+        if (txn_append_delta(txn, block_no, data, starts[i], ends[i] - starts[i]) == FALSE) {
+            return FALSE;
+        }
     }
+    return TRUE;
+}
+
+/*
+ * Places one or more transactions at the head of the circular log. When
+ * the log is short of space, the oldest transactions are checkpointed one
+ * at a time until the buffer fits, so sustained creates never stall on a
+ * full log. Each commit record gets the next txid and the checksum of its
+ * transaction. With --sync=commit or group the records go out first, a
+ * write per run between commit records, then a barrier, then every commit
+ * record in the buffer and the header, then
+ * a second barrier: one barrier pair per call however many transactions it
+ * holds. --sync=async writes everything before a single barrier, since
+ * replay rejects a commit whose records did not all reach the disk.
+ */
+int append_transaction(struct journal_header *jh, struct txn_buffer *txn) {
+    uint64_t pos;
+    uint32_t room;
+    uint32_t offset;
+    uint32_t start;
+    uint32_t txid = jh->head_txid;
+    uint32_t crc = 0;
+    struct rec_header pad;
+    struct rec_header *rec;
+    struct commit_record *commit;
+    struct journal_header moved;
+    int installed;
+    int ok = TRUE;
+    int freed = 0;
     
-    journal_data = malloc(jh.nbytes_used);
-    if (journal_data == NULL) {
-        printf("Error: Cannot allocate memory\n");
+    if (txn->len > journal_capacity()) {
+        fprintf(output, "Error: Transaction of %u bytes does not fit in the journal\n", txn->len);
         return FALSE;
     }
     
-    read_journal(0, journal_data, jh.nbytes_used);
-    
-    offset = sizeof(struct journal_header);
-    pending = 0;
-    
-    while (offset < jh.nbytes_used) {
-        rec = (struct rec_header *)(journal_data + offset);
-        
-        if (rec->size == 0) break;
-        if (offset + rec->size > jh.nbytes_used) break;
-        
-        if (rec->type == REC_DATA) {
-            data_rec = (struct data_record *)(journal_data + offset);
-            
-            if (pending < 16) {
-                write_blocks[pending] = data_rec->block_no;
-                write_data[pending] = malloc(BLOCK_SIZE);
-                memcpy(write_data[pending], data_rec->data, BLOCK_SIZE);
-                pending++;
-            }
-            offset += sizeof(struct data_record);
-        }
-        else if (rec->type == REC_COMMIT) {
-            for (i = 0; i < pending; i++) {
-                write_block(write_blocks[i], write_data[i]);
-                free(write_data[i]);
-            }
-            transactions++;
-            pending = 0;
-            offset += sizeof(struct commit_record);
+    for (;;) {
+        pos = jh->head;
+        room = journal_capacity() - (uint32_t)(pos % journal_capacity());
+        if (room < txn->len) {
+            pos += room;
         }
-        else {
+        if (pos + txn->len - jh->tail <= journal_capacity()) {
             break;
         }
+        installed = checkpoint_journal(jh, 1, NULL);
+        if (installed < 0) {
+            return FALSE;
+        }
+        if (installed == 0) {
+            fprintf(output, "Error: Journal is full. Please run './journal install' first.\n");
+            return FALSE;
+        }
+        freed++;
     }
     
-    if (pending > 0) {
-        printf("Warning: Discarding %d uncommitted writes\n", pending);
-        for (i = 0; i < pending; i++) {
-            free(write_data[i]);
-        }
+    if (freed > 0) {
+        fprintf(output, "Checkpointed %d transaction(s) to make room in the journal.\n", freed);
     }
     
-    jh.nbytes_used = sizeof(struct journal_header);
-    write_journal(0, &jh, sizeof(jh));
+    offset = 0;
+    while (offset < txn->len) {
+        rec = (struct rec_header *)(txn->data + offset);
+        if (rec->type == REC_COMMIT) {
+            commit = (struct commit_record *)rec;
+            commit->txid = txid++;
+            commit->crc = crc32c(crc, rec, offsetof(struct commit_record, crc));
+            crc = 0;
+        } else {
+            crc = crc32c(crc, rec, rec->size);
+        }
+        offset += rec->size;
+    }
     
-    free(journal_data);
+    if (pos != jh->head && room >= sizeof(struct rec_header)) {
+        pad.type = REC_PAD;
+        pad.size = sizeof(struct rec_header);
+        ok = write_journal(log_offset(jh->head), &pad, sizeof(pad));
+    }
     
-    printf("Success: Installed %d transaction(s) from journal.\n", transactions);
-    printf("Journal has been cleared.\n");
+    if (sync_mode == SYNC_NONE || sync_mode == SYNC_ASYNC) {
+        if (ok == TRUE) {
+            ok = write_journal(log_offset(pos), txn->data, txn->len);
+        }
+    } else {
+        offset = 0;
+        while (ok == TRUE && offset < txn->len) {
+            start = offset;
+            while (offset < txn->len &&
+                   ((struct rec_header *)(txn->data + offset))->type != REC_COMMIT) {
+                offset += ((struct rec_header *)(txn->data + offset))->size;
+            }
+            if (offset > start) {
+                ok = write_journal(log_offset(pos + start), txn->data + start, offset - start);
+            }
+            if (offset < txn->len) {
+                offset += ((struct rec_header *)(txn->data + offset))->size;
+            }
+        }
+        if (ok == TRUE && barrier() == FALSE) {
+            return FALSE;
+        }
+        offset = 0;
+        while (ok == TRUE && offset < txn->len) {
+            rec = (struct rec_header *)(txn->data + offset);
+            if (rec->type == REC_COMMIT) {
+                ok = write_journal(log_offset(pos + offset), rec, rec->size);
+            }
+            offset += rec->size;
+        }
+    }
     
+    /* The head only moves once the header saying so is written */
+    moved = *jh;
+    moved.head = pos + txn->len;
+    moved.head_txid = txid;
+    if (ok == TRUE) {
+        ok = write_journal(0, &moved, sizeof(moved));
+    }
+    if (ok == FALSE) {
+        fprintf(output, "Error: Cannot write to the journal\n");
+        return FALSE;
+    }
+    STAT_ADD(journal_bytes_appended, txn->len);
+    STAT_ADD(transactions_committed, txid - jh->head_txid);
+    *jh = moved;
+    if (sync_mode != SYNC_NONE && barrier() == FALSE) {
+        return FALSE;
+    }
     return TRUE;
 }
 
-int main(int argc, char *argv[]) {
-    int result;
+int cache_index_slot(struct block_cache *cache, uint32_t block_no) {
+    int slot = (int)((block_no * 2654435761U) & (uint32_t)(cache->index_cap - 1));
     
-    if (argc < 2) {
-        printf("Usage:\n");
-        printf("  %s create <filename>\n", argv[0]);
-        printf("  %s install\n", argv[0]);
-        return 1;
+    while (cache->index[slot] != 0 &&
+           cache->blocks[cache->index[slot] - 1]->block_no != block_no) {
+        slot = (slot + 1) & (cache->index_cap - 1);
+    }
+    return slot;
+}
+
+/* Indexes blocks[] afresh in cap slots, reusing the table when it is that big */
+int cache_reindex(struct block_cache *cache, int cap) {
+    int *index;
+    int i;
+    
+    if (cap != cache->index_cap) {
+        index = calloc(cap, sizeof(int));
+        if (index == NULL) {
+            return FALSE;
+        }
+        free(cache->index);
+        cache->index = index;
+        cache->index_cap = cap;
+    } else if (cap > 0) {
+        memset(cache->index, 0, cap * sizeof(int));
+    }
+    for (i = 0; i < cache->count; i++) {
+        cache->index[cache_index_slot(cache, cache->blocks[i]->block_no)] = i + 1;
+    }
+    return TRUE;
+}
+
+/*
+ * Empties one slot of the index, moving back later entries of the same
+ * probe run that would otherwise no longer be found.
+ */
+void cache_unindex(struct block_cache *cache, int slot) {
+    int mask = cache->index_cap - 1;
+    int next = (slot + 1) & mask;
+    int home;
+    
+    cache->index[slot] = 0;
+    while (cache->index[next] != 0) {
+        home = (int)((cache->blocks[cache->index[next] - 1]->block_no * 2654435761U) & (uint32_t)mask);
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            cache->index[slot] = cache->index[next];
+            cache->index[next] = 0;
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+}
+
+struct cached_block *cache_find(struct block_cache *cache, uint32_t block_no) {
+    struct cached_block *cb;
+    int slot;
+    
+    if (cache->index_cap == 0) {
+        return NULL;
+    }
+    slot = cache_index_slot(cache, block_no);
+    if (cache->index[slot] == 0) {
+        return NULL;
+    }
+    cb = cache->blocks[cache->index[slot] - 1];
+    __atomic_store_n(&cb->used, TRUE, __ATOMIC_RELAXED);
+    return cb;
+}
+
+/* Puts a block that is about to change on the touched list, once */
+void cache_touch(struct block_cache *cache, struct cached_block *cb) {
+    if (__atomic_exchange_n(&cb->touched, TRUE, __ATOMIC_ACQ_REL) == FALSE) {
+        pthread_mutex_lock(&cache->touch_lock);
+        cache->touched[cache->ntouched++] = cb;
+        pthread_mutex_unlock(&cache->touch_lock);
+    }
+}
+
+/*
+ * Reads a block as the log has it. The server's threads share no header
+ * copy, so it reads the current one under the commit lock; a one-shot
+ * command uses the one its transaction was built from.
+ */
+int cache_load(struct block_cache *cache, uint32_t block_no, uint8_t *buffer) {
+    struct journal_header now;
+    int ok;
+    
+    if (serving == FALSE) {
+        return read_block_logged(cache->jh, block_no, buffer);
+    }
+    if (lock_journal() == FALSE) {
+        return FALSE;
+    }
+    if (read_journal_header(&now) < 0) {
+        unlock_journal();
+        return FALSE;
+    }
+    ok = read_block_logged(&now, block_no, buffer);
+    unlock_journal();
+    return ok;
+}
+
+/*
+ * Returns a metadata block, loading it (with the journal's pending changes
+ * applied) the first time it is asked for.
+ */
+struct cached_block *cache_block(struct block_cache *cache, uint32_t block_no) {
+    struct cached_block *cb;
+    
+    pthread_rwlock_rdlock(&cache->lock);
+    cb = cache_find(cache, block_no);
+    pthread_rwlock_unlock(&cache->lock);
+    if (cb != NULL) {
+        return cb;
+    }
+    
+    pthread_rwlock_wrlock(&cache->lock);
+    cb = cache_find(cache, block_no);
+    if (cb != NULL) {
+        pthread_rwlock_unlock(&cache->lock);
+        return cb;
+    }
+    
+    if (cache->count == cache->cap) {
+        int cap = cache->cap ? cache->cap * 2 : 8;
+        struct cached_block **grown = realloc(cache->blocks, cap * sizeof(*grown));
+        if (grown == NULL) {
+            pthread_rwlock_unlock(&cache->lock);
+            return NULL;
+        }
+        cache->blocks = grown;
+        pthread_mutex_lock(&cache->touch_lock);
+        grown = realloc(cache->touched, cap * sizeof(*grown));
+        if (grown != NULL) {
+            cache->touched = grown;
+        }
+        pthread_mutex_unlock(&cache->touch_lock);
+        if (grown == NULL) {
+            pthread_rwlock_unlock(&cache->lock);
+            return NULL;
+        }
+        cache->cap = cap;
+    }
+    if ((cache->count + 1) * 2 > cache->index_cap &&
+        cache_reindex(cache, cache->index_cap ? cache->index_cap * 2 : 64) == FALSE) {
+        pthread_rwlock_unlock(&cache->lock);
+        return NULL;
+    }
+    
+    cb = malloc(sizeof(*cb));
+    if (cb == NULL) {
+        pthread_rwlock_unlock(&cache->lock);
+        return NULL;
+    }
+    if (cache_load(cache, block_no, cb->orig) == FALSE) {
+        fprintf(output, "Error: Cannot read block %u\n", block_no);
+        pthread_rwlock_unlock(&cache->lock);
+        free(cb);
+        return NULL;
+    }
+    cb->block_no = block_no;
+    pthread_mutex_init(&cb->lock, NULL);
+    cb->log_pass = 0;
+    cb->touched = FALSE;
+    cb->used = TRUE;
+    memcpy(cb->data, cb->orig, BLOCK_SIZE);
+    cache->blocks[cache->count++] = cb;
+    cache->index[cache_index_slot(cache, block_no)] = cache->count;
+    pthread_rwlock_unlock(&cache->lock);
+    return cb;
+}
+
+/* The updated copy of a metadata block, which the caller may change */
+uint8_t *cache_get(struct block_cache *cache, uint32_t block_no) {
+    struct cached_block *cb = cache_block(cache, block_no);
+    
+    if (cb == NULL) {
+        return NULL;
+    }
+    cache_touch(cache, cb);
+    return cb->data;
+}
+
+void cache_free(struct block_cache *cache) {
+    int i;
+    
+    for (i = 0; i < cache->count; i++) {
+        pthread_mutex_destroy(&cache->blocks[i]->lock);
+        free(cache->blocks[i]);
+    }
+    free(cache->blocks);
+    free(cache->index);
+    free(cache->touched);
+    cache->blocks = NULL;
+    cache->count = 0;
+    cache->cap = 0;
+    cache->index = NULL;
+    cache->index_cap = 0;
+    cache->touched = NULL;
+    cache->ntouched = 0;
+}
+
+struct inode *get_inode(struct block_cache *cache, uint32_t inode_no) {
+    uint8_t *block = cache_get(cache, vsfs_inode_block(&sb, inode_no));
+    
+    if (block == NULL) {
+        return NULL;
+    }
+    return &((struct inode *)block)[vsfs_inode_slot(inode_no)];
+}
+
+/*
+ * Adds a change to the transaction being built. Callers that cannot back
+ * out reserve room first with txn_reserve(); a NULL list records nothing.
+ */
+int txn_reserve(struct txn_changes *changes, int n) {
+    if (changes != NULL && changes->count + n > changes->cap) {
+        int cap = changes->cap ? changes->cap : 16;
+        struct txn_change *grown;
+        while (cap < changes->count + n) cap *= 2;
+        grown = realloc(changes->list, cap * sizeof(*grown));
+        if (grown == NULL) {
+            return FALSE;
+        }
+        changes->list = grown;
+        changes->cap = cap;
+    }
+    return TRUE;
+}
+
+int txn_note(struct txn_changes *changes, struct cached_block *cb, uint32_t offset,
+             uint32_t length, int kind, uint32_t value) {
+    struct txn_change *c;
+    
+    if (changes == NULL) {
+        return TRUE;
+    }
+    if (txn_reserve(changes, 1) == FALSE) {
+        return FALSE;
+    }
+    c = &changes->list[changes->count++];
+    c->cb = cb;
+    c->offset = (uint16_t)offset;
+    c->length = (uint16_t)length;
+    c->kind = (uint8_t)kind;
+    c->value = value;
+    return TRUE;
+}
+
+/*
+ * Sets the first clear bit in [from, to) of a bitmap that spans
+ * consecutive blocks starting at first_block, and returns it, or to if
+ * there is none. Each block is searched under its lock, so parallel
+ * creates never claim the same bit.
+ */
+uint32_t claim_clear_bit(struct block_cache *cache, uint32_t first_block, uint32_t from, uint32_t to,
+                         struct txn_changes *changes) {
+    uint32_t b, start, end, idx;
+    struct cached_block *cb;
+    
+    while (from < to) {
+        b = from / BITS_PER_BLOCK;
+        start = from % BITS_PER_BLOCK;
+        end = (to - b * BITS_PER_BLOCK < BITS_PER_BLOCK) ? to - b * BITS_PER_BLOCK : BITS_PER_BLOCK;
+        cb = cache_block(cache, first_block + b);
+        if (cb == NULL) {
+            return to;
+        }
+        pthread_mutex_lock(&cb->lock);
+        idx = bitmap_find_zero(cb->data, start, end);
+        if (idx < end) {
+            cache_touch(cache, cb);
+            bitmap_set(cb->data, idx);
+        }
+        pthread_mutex_unlock(&cb->lock);
+        if (idx < end) {
+            txn_note(changes, cb, idx / 8, 1, CHANGE_BITS, 1U << (idx % 8));
+            return b * BITS_PER_BLOCK + idx;
+        }
+        from = (b + 1) * BITS_PER_BLOCK;
+    }
+    return to;
+}
+
+/*
+ * Allocates a bit in [lowest, nbits), searching from *hint to the end and
+ * then wrapping around, and moves the hint past it. Consecutive
+ * allocations therefore never rescan the full part of the bitmap.
+ */
+int alloc_bit(struct block_cache *cache, uint32_t first_block, uint32_t lowest,
+              uint32_t nbits, uint32_t *hint, struct txn_changes *changes) {
+    uint32_t start = (*hint >= lowest && *hint < nbits) ? *hint : lowest;
+    uint32_t idx;
+    uint32_t scanned;
+    
+    idx = claim_clear_bit(cache, first_block, start, nbits, changes);
+    if (idx == nbits) {
+        idx = claim_clear_bit(cache, first_block, lowest, start, changes);
+        if (idx == start) {
+            STAT_ADD(alloc_bits_scanned, nbits - lowest);
+            return -1;
+        }
+        scanned = (nbits - start) + (idx - lowest) + 1;
+    } else {
+        scanned = idx - start + 1;
+    }
+    if (show_stats) {
+        STAT_ADD(allocations, 1);
+        STAT_ADD(alloc_bits_scanned, scanned);
+        stat_max(&stats.alloc_max_scan, scanned);
+    }
+    *hint = idx + 1;
+    return (int)idx;
+}
+
+/* Clears a bit of a bitmap that spans consecutive blocks from first_block */
+void release_bit(struct block_cache *cache, uint32_t first_block, uint32_t idx) {
+    struct cached_block *cb = cache_block(cache, vsfs_bitmap_block(first_block, idx));
+    
+    if (cb != NULL) {
+        cache_touch(cache, cb);
+        pthread_mutex_lock(&cb->lock);
+        bitmap_clear(cb->data, vsfs_bitmap_bit(idx));
+        pthread_mutex_unlock(&cb->lock);
+    }
+}
+
+/* Allocates an inode, never handing out inode 0 (the root directory) */
+int alloc_inode(struct block_cache *cache, struct txn_changes *changes) {
+    return alloc_bit(cache, sb.inode_bitmap, 1, sb.inode_count, &inode_hint, changes);
+}
+
+/* Allocates a data block, returning its block number or 0 if none is free */
+uint32_t alloc_data_block(struct block_cache *cache, struct txn_changes *changes) {
+    int idx = alloc_bit(cache, sb.data_bitmap, 0, sb.total_blocks - sb.data_start, &data_hint, changes);
+    
+    if (idx < 0) {
+        return 0;
+    }
+    return sb.data_start + (uint32_t)idx;
+}
+
+void free_data_block(struct block_cache *cache, uint32_t block_no) {
+    release_bit(cache, sb.data_bitmap, block_no - sb.data_start);
+}
+
+/* Sets (value 1) or clears bits [from, to) of a bitmap spanning blocks from first_block */
+void fill_bits(struct block_cache *cache, uint32_t first_block, uint32_t from, uint32_t to, int value) {
+    uint32_t b, lo, hi;
+    struct cached_block *cb;
+    
+    while (from < to) {
+        b = from / BITS_PER_BLOCK;
+        lo = from % BITS_PER_BLOCK;
+        hi = (to - b * BITS_PER_BLOCK < BITS_PER_BLOCK) ? to - b * BITS_PER_BLOCK : BITS_PER_BLOCK;
+        cb = cache_block(cache, first_block + b);
+        if (cb != NULL) {
+            cache_touch(cache, cb);
+            pthread_mutex_lock(&cb->lock);
+            bitmap_fill(cb->data, lo, hi, value);
+            pthread_mutex_unlock(&cb->lock);
+        }
+        from = b * BITS_PER_BLOCK + hi;
+    }
+}
+
+/*
+ * Finds the first clear bit at or after from in a bitmap spanning blocks
+ * from first_block, and returns it (nbits if there is none) with the
+ * length of the clear run there, up to want, in *len. A run may cross
+ * into the next bitmap block.
+ */
+uint32_t find_clear_run(struct block_cache *cache, uint32_t first_block, uint32_t from, uint32_t nbits,
+                        uint32_t want, uint32_t *len) {
+    uint32_t start = nbits;
+    uint32_t b, lo, hi, stop, idx;
+    struct cached_block *cb;
+    
+    *len = 0;
+    while (from < nbits) {
+        b = from / BITS_PER_BLOCK;
+        lo = from % BITS_PER_BLOCK;
+        hi = (nbits - b * BITS_PER_BLOCK < BITS_PER_BLOCK) ? nbits - b * BITS_PER_BLOCK : BITS_PER_BLOCK;
+        cb = cache_block(cache, first_block + b);
+        if (cb == NULL) {
+            return nbits;
+        }
+        pthread_mutex_lock(&cb->lock);
+        if (start == nbits) {
+            lo = bitmap_find_zero(cb->data, lo, hi);
+            if (lo < hi) {
+                start = b * BITS_PER_BLOCK + lo;
+            }
+        }
+        idx = hi;
+        if (start != nbits) {
+            stop = (hi - lo > want - *len) ? lo + (want - *len) : hi;
+            idx = bitmap_find(cb->data, lo, stop, 1);
+            *len += idx - lo;
+        }
+        pthread_mutex_unlock(&cb->lock);
+        if (idx < hi || *len == want) {
+            break;
+        }
+        from = (b + 1) * BITS_PER_BLOCK;
+    }
+    return start;
+}
+
+/*
+ * Allocates up to want consecutive data blocks: the first run that long
+ * from the hint on (wrapping around), or else the longest run there is.
+ * Returns its first block and sets *len, or returns 0 when no block is
+ * free. Only write allocates extents, and it runs alone even in the
+ * server, so nothing claims the run between the search and the claim.
+ */
+uint32_t alloc_data_extent(struct block_cache *cache, uint32_t want, uint32_t *len) {
+    uint32_t nbits = sb.total_blocks - sb.data_start;
+    uint32_t hint = (data_hint < nbits) ? data_hint : 0;
+    uint32_t from = hint;
+    uint32_t best = nbits;
+    uint32_t best_len = 0;
+    uint32_t start;
+    uint32_t run;
+    uint64_t scanned = 0;
+    int wrapped = FALSE;
+    
+    for (;;) {
+        start = find_clear_run(cache, sb.data_bitmap, from, wrapped ? hint : nbits, want, &run);
+        scanned += (uint64_t)(start - from) + run;
+        if (start == (wrapped ? hint : nbits)) {
+            if (wrapped || hint == 0) {
+                break;
+            }
+            wrapped = TRUE;
+            from = 0;
+            continue;
+        }
+        if (run > best_len) {
+            best = start;
+            best_len = run;
+        }
+        if (run == want) {
+            break;
+        }
+        from = start + run;
+    }
+    if (show_stats) {
+        STAT_ADD(allocations, 1);
+        STAT_ADD(alloc_bits_scanned, scanned);
+        stat_max(&stats.alloc_max_scan, scanned);
+    }
+    if (best_len == 0) {
+        return 0;
+    }
+    fill_bits(cache, sb.data_bitmap, best, best + best_len, 1);
+    data_hint = best + best_len;
+    *len = best_len;
+    return sb.data_start + best;
+}
+
+/* Frees every block of a file, whether mapped by direct[] or extents[] */
+void free_file_blocks(struct block_cache *cache, struct inode *ino) {
+    uint32_t nbits = sb.total_blocks - sb.data_start;
+    uint32_t idx;
+    uint32_t i;
+    
+    if (ino->flags & INODE_EXTENTS) {
+        for (i = 0; i < INODE_EXTENT_COUNT && ino->extents[i].length != 0; i++) {
+            idx = ino->extents[i].start - sb.data_start;
+            if (ino->extents[i].start >= sb.data_start && idx < nbits && ino->extents[i].length <= nbits - idx) {
+                fill_bits(cache, sb.data_bitmap, idx, idx + ino->extents[i].length, 0);
+            }
+        }
+    } else {
+        for (i = 0; i < DIRECT_POINTERS; i++) {
+            if (ino->direct[i] != 0) {
+                free_data_block(cache, ino->direct[i]);
+            }
+        }
+    }
+    memset(ino->direct, 0, sizeof(ino->direct));
+    memset(ino->extents, 0, sizeof(ino->extents));
+    ino->flags &= ~INODE_EXTENTS;
+}
+
+/* Entry e of the root directory, or NULL if its block cannot be read */
+struct dirent *dir_entry(struct block_cache *cache, struct inode *root, uint32_t e) {
+    uint8_t *block = cache_get(cache, root->direct[vsfs_dirent_block(e)]);
+    
+    if (block == NULL) {
+        return NULL;
+    }
+    return &((struct dirent *)block)[vsfs_dirent_slot(e)];
+}
+
+uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261U;
+    
+    while (*name != '\0') {
+        h = (h ^ (uint8_t)*name++) * 16777619U;
+    }
+    return h;
+}
+
+void dir_index_free(struct dir_index *dir) {
+    free(dir->slots);
+    free(dir->hashes);
+    free(dir->free);
+    memset(dir, 0, sizeof(*dir));
+}
+
+/* Makes room for one more entry, so the next insert cannot fail */
+int dir_index_reserve(struct dir_index *dir) {
+    uint32_t slot;
+    uint32_t i;
+    
+    if ((dir->used + 1) * 2 > dir->slot_cap) {
+        uint32_t cap = dir->slot_cap ? dir->slot_cap * 2 : 2 * DIRENTS_PER_BLOCK;
+        uint32_t *slots = calloc(cap, sizeof(uint32_t));
+        uint32_t *hashes = malloc(cap * sizeof(uint32_t));
+        if (slots == NULL || hashes == NULL) {
+            free(slots);
+            free(hashes);
+            return FALSE;
+        }
+        for (i = 0; i < dir->slot_cap; i++) {
+            if (dir->slots[i] != 0) {
+                slot = dir->hashes[i] & (cap - 1);
+                while (slots[slot] != 0) slot = (slot + 1) & (cap - 1);
+                slots[slot] = dir->slots[i];
+                hashes[slot] = dir->hashes[i];
+            }
+        }
+        free(dir->slots);
+        free(dir->hashes);
+        dir->slots = slots;
+        dir->hashes = hashes;
+        dir->slot_cap = cap;
+    }
+    return TRUE;
+}
+
+int dir_index_insert(struct dir_index *dir, uint32_t hash, uint32_t e) {
+    uint32_t slot;
+    
+    if (dir_index_reserve(dir) == FALSE) {
+        return FALSE;
+    }
+    slot = hash & (dir->slot_cap - 1);
+    while (dir->slots[slot] != 0) slot = (slot + 1) & (dir->slot_cap - 1);
+    dir->slots[slot] = e + 1;
+    dir->hashes[slot] = hash;
+    dir->used++;
+    if ((int)e > dir->highest) {
+        dir->highest = (int)e;
+    }
+    return TRUE;
+}
+
+/*
+ * Indexes every entry of the root directory's blocks and stacks the free
+ * ones so the lowest is handed out first.
+ */
+int dir_index_build(struct dir_index *dir, struct block_cache *cache, struct inode *root) {
+    uint32_t nblocks = 0;
+    uint32_t e;
+    struct dirent *de;
+    
+    dir_index_free(dir);
+    dir->highest = -1;
+    while (nblocks < 8 && root->direct[nblocks] != 0) nblocks++;
+    
+    dir->free = malloc(nblocks * DIRENTS_PER_BLOCK * sizeof(uint32_t));
+    if (dir->free == NULL) {
+        return FALSE;
+    }
+    for (e = nblocks * DIRENTS_PER_BLOCK; e-- > 0; ) {
+        de = dir_entry(cache, root, e);
+        if (de == NULL) {
+            return FALSE;
+        }
+        if (de->name[0] == '\0') {
+            dir->free[dir->nfree++] = e;
+        } else if (dir_index_insert(dir, name_hash(de->name), e) == FALSE) {
+            return FALSE;
+        }
+    }
+    dir->built = TRUE;
+    return TRUE;
+}
+
+/*
+ * Adds a zeroed block to the root directory from the data bitmap and
+ * stacks its entries as free. Fails when every direct[] pointer is used.
+ * The caller holds dir_lock.
+ */
+int dir_grow(struct dir_index *dir, struct block_cache *cache, struct inode *root,
+             struct txn_changes *changes) {
+    uint32_t nblocks = 0;
+    uint32_t block_no;
+    uint32_t *grown;
+    uint32_t e;
+    struct cached_block *cb;
+    struct cached_block *root_cb;
+    
+    while (nblocks < 8 && root->direct[nblocks] != 0) nblocks++;
+    if (nblocks == 8) {
+        return FALSE;
+    }
+    
+    grown = realloc(dir->free, (nblocks + 1) * DIRENTS_PER_BLOCK * sizeof(uint32_t));
+    if (grown == NULL) {
+        return FALSE;
+    }
+    dir->free = grown;
+    if (txn_reserve(changes, 3) == FALSE) {
+        return FALSE;
+    }
+    
+    root_cb = cache_block(cache, sb.inode_start);
+    block_no = (root_cb != NULL) ? alloc_data_block(cache, changes) : 0;
+    if (block_no == 0) {
+        return FALSE;
+    }
+    cb = cache_block(cache, block_no);
+    if (cb == NULL) {
+        free_data_block(cache, block_no);
+        if (changes != NULL) changes->count--;
+        return FALSE;
+    }
+    cache_touch(cache, cb);
+    pthread_mutex_lock(&cb->lock);
+    memset(cb->data, 0, BLOCK_SIZE);
+    pthread_mutex_unlock(&cb->lock);
+    txn_note(changes, cb, 0, BLOCK_SIZE, CHANGE_ZERO, 0);
+    
+    cache_touch(cache, root_cb);
+    pthread_mutex_lock(&root_cb->lock);
+    root->direct[nblocks] = block_no;
+    pthread_mutex_unlock(&root_cb->lock);
+    txn_note(changes, root_cb, offsetof(struct inode, direct) + nblocks * sizeof(uint32_t),
+             sizeof(uint32_t), CHANGE_BYTES, 0);
+    
+    for (e = (nblocks + 1) * DIRENTS_PER_BLOCK; e-- > nblocks * DIRENTS_PER_BLOCK; ) {
+        dir->free[dir->nfree++] = e;
+    }
+    return TRUE;
+}
+
+/* Returns the entry named name, or -1 if the directory has none */
+int dir_index_lookup(struct dir_index *dir, struct block_cache *cache, struct inode *root,
+                     const char *name, uint32_t hash) {
+    uint32_t slot;
+    struct dirent *de;
+    
+    if (dir->slot_cap == 0) {
+        return -1;
+    }
+    for (slot = hash & (dir->slot_cap - 1); dir->slots[slot] != 0;
+         slot = (slot + 1) & (dir->slot_cap - 1)) {
+        if (dir->hashes[slot] != hash) continue;
+        de = dir_entry(cache, root, dir->slots[slot] - 1);
+        if (de != NULL && strncmp(de->name, name, sizeof(de->name)) == 0) {
+            return (int)(dir->slots[slot] - 1);
+        }
+    }
+    return -1;
+}
+
+/* Removes one block, e.g. file data that should not stay cached */
+void cache_forget(struct block_cache *cache, uint32_t block_no) {
+    struct cached_block *cb;
+    int slot;
+    int i;
+    
+    if (cache->index_cap == 0) {
+        return;
+    }
+    slot = cache_index_slot(cache, block_no);
+    if (cache->index[slot] == 0) {
+        return;
+    }
+    i = cache->index[slot] - 1;
+    cb = cache->blocks[i];
+    cache_unindex(cache, slot);
+    cache->blocks[i] = cache->blocks[--cache->count];
+    if (i < cache->count) {
+        cache->index[cache_index_slot(cache, cache->blocks[i]->block_no)] = i + 1;
+    }
+    for (i = 0; cb->touched && i < cache->ntouched; i++) {
+        if (cache->touched[i] == cb) {
+            cache->touched[i] = cache->touched[--cache->ntouched];
+            break;
+        }
+    }
+    pthread_mutex_destroy(&cb->lock);
+    free(cb);
+}
+
+/*
+ * Puts back the logged copy of every block a failed command changed but
+ * never logged. The directory index may describe those changes, so it is
+ * rebuilt on next use.
+ */
+void cache_settle(struct block_cache *cache, struct dir_index *dir) {
+    struct cached_block *cb;
+    int reverted = FALSE;
+    int i;
+    
+    for (i = 0; i < cache->ntouched; i++) {
+        cb = cache->touched[i];
+        if (memcmp(cb->orig, cb->data, BLOCK_SIZE) != 0) {
+            memcpy(cb->data, cb->orig, BLOCK_SIZE);
+            reverted = TRUE;
+        }
+        cb->touched = FALSE;
+    }
+    cache->ntouched = 0;
+    if (reverted) {
+        dir_index_free(dir);
+    }
+}
+
+/*
+ * Evicts clean blocks until at most max are left: first those nobody
+ * looked up since the last sweep, then any others. Runs while no
+ * command does, when every change is logged or reverted, so no block is
+ * in use and none differs from its logged copy.
+ */
+void cache_trim(struct block_cache *cache, int max) {
+    struct cached_block *cb;
+    int excess;
+    int pass;
+    int n;
+    int i;
+    
+    for (i = 0; i < cache->ntouched; i++) {
+        cache->touched[i]->touched = FALSE;
+    }
+    cache->ntouched = 0;
+    excess = cache->count - max;
+    for (pass = 0; pass < 2 && excess > 0; pass++) {
+        n = 0;
+        for (i = 0; i < cache->count; i++) {
+            cb = cache->blocks[i];
+            if (excess > 0 && cb->used == FALSE) {
+                pthread_mutex_destroy(&cb->lock);
+                free(cb);
+                excess--;
+                continue;
+            }
+            cb->used = FALSE;
+            cache->blocks[n++] = cb;
+        }
+        cache->count = n;
+        cache_reindex(cache, cache->index_cap);
+    }
+}
+
+/* Forgets everything, for when the original copies no longer match the log */
+void cache_drop(struct block_cache *cache, struct dir_index *dir) {
+    cache_free(cache);
+    dir_index_free(dir);
+}
+
+/*
+ * Drops the shared cache after a failed commit. Other creates in the
+ * server may still be using it, so there it goes once no command runs.
+ */
+void cache_discard(void) {
+    if (serving) {
+        meta_stale = 1;
+    } else {
+        cache_drop(&meta_cache, &meta_dir);
+    }
+}
+
+int compare_block_nos(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Takes the commit lock and brings *jh up to date for appending. Returns
+ * FALSE (still holding the lock) when a transaction committed since *jh
+ * was read logged a block the cache has loaded: what was built from the
+ * cache is then stale and must be rebuilt. Blocks it never read cannot
+ * conflict, since a delta only records what changed. Returns -1, with the
+ * error printed and the lock not held, when the check itself failed.
+ */
+int lock_for_commit(struct block_cache *cache, struct journal_header *jh) {
+    struct journal_header now;
+    const uint8_t *journal_data;
+    uint8_t *to_free;
+    const struct rec_header *rec;
+    uint32_t *loaded;
+    uint32_t block_no;
+    uint64_t pos;
+    uint64_t end;
+    uint32_t txid;
+    int conflict = FALSE;
+    int i;
+    
+    if (lock_journal() == FALSE) {
+        return -1;
+    }
+    if (read_journal_header(&now) < 0) {
+        unlock_journal();
+        return -1;
+    }
+    /* The server has the image to itself: only its own commits came first */
+    if (serving || now.head == jh->head) {
+        *jh = now;
+        return TRUE;
+    }
+    /* Records checkpointed away (or a reset log) can no longer be checked */
+    if (now.head < jh->head || now.tail > jh->head) {
+        *jh = now;
+        return FALSE;
+    }
+    
+    journal_data = get_journal_area(&to_free);
+    if (journal_data == NULL) {
+        unlock_journal();
+        return -1;
+    }
+    /* What this command read, sorted, so each logged block costs a search */
+    loaded = malloc((cache->count + 1) * sizeof(uint32_t));
+    if (loaded == NULL) {
+        fprintf(output, "Error: Cannot allocate memory\n");
+        free(to_free);
+        unlock_journal();
+        return -1;
+    }
+    for (i = 0; i < cache->count; i++) {
+        loaded[i] = cache->blocks[i]->block_no;
+    }
+    qsort(loaded, cache->count, sizeof(uint32_t), compare_block_nos);
+    pos = jh->head;
+    txid = jh->head_txid;
+    while (conflict == FALSE && pos < now.head) {
+        if (verify_transaction(journal_data, &pos, now.head, txid, &end, NULL) == FALSE) {
+            conflict = TRUE;
+            break;
+        }
+        while (conflict == FALSE && (rec = next_record(journal_data, &pos, end)) != NULL) {
+            if (rec->type == REC_DATA || rec->type == REC_DELTA) {
+                /* Both record types keep block_no right after the header */
+                block_no = ((const struct data_record *)rec)->block_no;
+                if (bsearch(&block_no, loaded, cache->count, sizeof(uint32_t), compare_block_nos) != NULL) {
+                    conflict = TRUE;
+                }
+            }
+            pos += rec->size;
+        }
+        txid++;
+    }
+    free(loaded);
+    free(to_free);
+    *jh = now;
+    return (conflict == FALSE) ? TRUE : FALSE;
+}
+
+/*
+ * Logs the changes to each touched block since its original copy, closes
+ * the transaction with a commit record, and makes the current copies the
+ * new originals for the next transaction in the same buffer.
+ */
+int log_transaction(struct txn_buffer *txn, struct block_cache *cache) {
+    struct commit_record commit_rec;
+    struct cached_block *cb;
+    int i;
+    
+    for (i = 0; i < cache->ntouched; i++) {
+        cb = cache->touched[i];
+        if (memcmp(cb->orig, cb->data, BLOCK_SIZE) == 0) {
+            continue;
+        }
+        if (log_block(txn, cb->block_no, cb->orig, cb->data) == FALSE) {
+            return FALSE;
+        }
+        memcpy(cb->orig, cb->data, BLOCK_SIZE);
+    }
+    for (i = 0; i < cache->ntouched; i++) {
+        cache->touched[i]->touched = FALSE;
+    }
+    cache->ntouched = 0;
+    
+    commit_rec.hdr.type = REC_COMMIT;
+    commit_rec.hdr.size = sizeof(struct commit_record);
+    commit_rec.txid = 0;    /* numbered and checksummed by append_transaction */
+    commit_rec.crc = 0;
+    return txn_append(txn, &commit_rec, sizeof(commit_rec));
+}
+
+/*
+ * Logs each transaction in changes: every block it changed, as the
+ * block's logged copy with the transaction's own changes applied, then a
+ * commit record. The results become the logged copies, so this runs under
+ * the commit lock, in the order the transactions are appended.
+ */
+int log_changes(struct txn_buffer *txn, struct txn_changes *changes) {
+    /*
+     * Numbers the transactions logged so far, so each block's log_pass says
+     * whether this transaction already logged it. Shared by every thread
+     * but only touched under the commit lock, which all callers hold; a
+     * mark could only match a later pass after 2^32 transactions.
+     */
+    static uint32_t pass = 0;
+    struct commit_record commit_rec;
+    struct txn_change *c;
+    struct txn_change *d;
+    uint8_t image[BLOCK_SIZE];
+    uint32_t size;
+    int first = 0;
+    int i;
+    int j;
+    
+    for (i = 0; i < changes->count; i++) {
+        c = &changes->list[i];
+        if (c->kind == CHANGE_COMMIT) {
+            commit_rec.hdr.type = REC_COMMIT;
+            commit_rec.hdr.size = sizeof(struct commit_record);
+            commit_rec.txid = 0;    /* numbered and checksummed by append_transaction */
+            commit_rec.crc = 0;
+            if (txn_append(txn, &commit_rec, sizeof(commit_rec)) == FALSE) {
+                return FALSE;
+            }
+            first = i + 1;
+            continue;
+        }
+        /* Each block once per transaction, at its first change */
+        if (i == first) {
+            pass++;
+        }
+        if (c->cb->log_pass == pass) {
+            continue;
+        }
+        c->cb->log_pass = pass;
+        
+        memcpy(image, c->cb->orig, BLOCK_SIZE);
+        pthread_mutex_lock(&c->cb->lock);
+        for (j = i; j < changes->count && changes->list[j].kind != CHANGE_COMMIT; j++) {
+            d = &changes->list[j];
+            if (d->cb != c->cb) continue;
+            if (d->kind == CHANGE_BYTES) {
+                memcpy(image + d->offset, c->cb->data + d->offset, d->length);
+            } else if (d->kind == CHANGE_ZERO) {
+                memset(image + d->offset, 0, d->length);
+            } else if (d->kind == CHANGE_BITS) {
+                image[d->offset] |= (uint8_t)d->value;
+            } else if (d->kind == CHANGE_MAX) {
+                memcpy(&size, image + d->offset, sizeof(size));
+                if (d->value > size) {
+                    memcpy(image + d->offset, &d->value, sizeof(d->value));
+                }
+            }
+        }
+        pthread_mutex_unlock(&c->cb->lock);
+        
+        if (log_block(txn, c->cb->block_no, c->cb->orig, image) == FALSE) {
+            return FALSE;
+        }
+        memcpy(c->cb->orig, image, BLOCK_SIZE);
+    }
+    return TRUE;
+}
+
+/*
+ * Commits a block the server added to the root directory on its own,
+ * before any create can take one of its entries: a create that does may
+ * well commit before the one that grew the directory.
+ */
+int commit_growth(struct txn_changes *growth) {
+    struct journal_header jh;
+    struct txn_buffer txn = { NULL, 0, 0 };
+    int locked;
+    int ok;
+    
+    if (txn_note(growth, NULL, 0, 0, CHANGE_COMMIT, 0) == FALSE) {
+        return FALSE;
+    }
+    locked = lock_for_commit(&meta_cache, &jh);
+    if (locked != TRUE) {
+        if (locked == FALSE) {
+            unlock_journal();
+        }
+        meta_stale = 1;
+        return FALSE;
+    }
+    ok = log_changes(&txn, growth) && append_transaction(&jh, &txn);
+    if (ok == FALSE) {
+        meta_stale = 1;
+    }
+    unlock_journal();
+    free(txn.data);
+    return ok;
+}
+
+/*
+ * Creates one file, noting every change in changes. The inode is taken
+ * first, from this thread's part of the bitmap; the directory is only
+ * held for the lookup and the entry, and nothing can fail after it.
+ */
+int apply_create(struct block_cache *cache, struct dir_index *dir, const char *filename,
+                 struct txn_changes *changes) {
+    int free_inode;
+    uint32_t free_slot;
+    uint32_t hash;
+    uint32_t hint = inode_hint;
+    int mark;
+    struct txn_changes growth = { NULL, 0, 0 };
+    struct cached_block *root_cb;
+    struct cached_block *inode_cb;
+    struct cached_block *entry_cb;
+    struct inode *root;
+    struct inode *ino;
+    struct dirent *de;
+    uint32_t current_time;
+    
+    if (strlen(filename) > NAME_LEN - 1) {
+        fprintf(output, "Error: Filename too long (max %u characters)\n", NAME_LEN - 1);
+        return FALSE;
+    }
+    if (txn_reserve(changes, 8) == FALSE) {
+        fprintf(output, "Error: Cannot allocate memory\n");
+        return FALSE;
+    }
+    mark = changes->count;
+    
+    free_inode = alloc_inode(cache, changes);
+    if (free_inode == -1) {
+        fprintf(output, "Error: No free inodes available\n");
+        return FALSE;
+    }
+    inode_cb = cache_block(cache, vsfs_inode_block(&sb, free_inode));
+    root_cb = cache_block(cache, sb.inode_start);
+    if (inode_cb == NULL || root_cb == NULL) {
+        goto undo;
+    }
+    root = (struct inode *)root_cb->data;
+    
+    pthread_mutex_lock(&dir_lock);
+    if (dir->built == FALSE && dir_index_build(dir, cache, root) == FALSE) {
+        fprintf(output, "Error: Cannot read root directory\n");
+        goto unlock;
+    }
+    hash = name_hash(filename);
+    if (dir_index_lookup(dir, cache, root, filename, hash) >= 0) {
+        fprintf(output, "Error: File '%s' already exists\n", filename);
+        goto unlock;
+    }
+    if (dir_index_reserve(dir) == FALSE) {
+        fprintf(output, "Error: Cannot allocate memory\n");
+        goto unlock;
+    }
+    if (dir->nfree == 0) {
+        if (dir_grow(dir, cache, root, serving ? &growth : changes) == FALSE) {
+            fprintf(output, "Error: Root directory is full\n");
+            free(growth.list);
+            goto unlock;
+        }
+        if (serving && commit_growth(&growth) == FALSE) {
+            dir->nfree = 0;     /* the cache is dropped before anyone can use them */
+            free(growth.list);
+            goto unlock;
+        }
+        free(growth.list);
+    }
+    free_slot = dir->free[dir->nfree - 1];
+    entry_cb = cache_block(cache, root->direct[vsfs_dirent_block(free_slot)]);
+    if (entry_cb == NULL) {
+        goto unlock;
+    }
+    
+    current_time = (uint32_t)time(NULL);
+    cache_touch(cache, inode_cb);
+    pthread_mutex_lock(&inode_cb->lock);
+    ino = &((struct inode *)inode_cb->data)[vsfs_inode_slot(free_inode)];
+    ino->type = INODE_FILE;
+    ino->links = 1;
+    ino->size = 0;
+    memset(ino->direct, 0, sizeof(ino->direct));
+    ino->ctime = current_time;
+    ino->mtime = current_time;
+    pthread_mutex_unlock(&inode_cb->lock);
+    txn_note(changes, inode_cb, vsfs_inode_slot(free_inode) * sizeof(struct inode),
+             sizeof(struct inode), CHANGE_BYTES, 0);
+    
+    dir_index_insert(dir, hash, free_slot);
+    dir->nfree--;
+    
+    cache_touch(cache, entry_cb);
+    pthread_mutex_lock(&entry_cb->lock);
+    de = &((struct dirent *)entry_cb->data)[vsfs_dirent_slot(free_slot)];
+    de->inode = free_inode;
+    memset(de->name, 0, NAME_LEN);
+    strncpy(de->name, filename, NAME_LEN - 1);
+    pthread_mutex_unlock(&entry_cb->lock);
+    txn_note(changes, entry_cb, vsfs_dirent_slot(free_slot) * sizeof(struct dirent),
+             sizeof(struct dirent), CHANGE_BYTES, 0);
+    
+    /* Creates commit in any order; the size only ever covers committed entries */
+    cache_touch(cache, root_cb);
+    pthread_mutex_lock(&root_cb->lock);
+    root->size = (dir->highest + 1) * sizeof(struct dirent);
+    pthread_mutex_unlock(&root_cb->lock);
+    txn_note(changes, root_cb, offsetof(struct inode, size), sizeof(uint32_t), CHANGE_MAX,
+             (free_slot + 1) * sizeof(struct dirent));
+    pthread_mutex_unlock(&dir_lock);
+    
+    fprintf(output, "Success: File '%s' logged to journal (inode %d)\n", filename, free_inode);
+    return TRUE;
+    
+unlock:
+    pthread_mutex_unlock(&dir_lock);
+undo:
+    release_bit(cache, sb.inode_bitmap, (uint32_t)free_inode);
+    changes->count = mark;
+    inode_hint = hint;
+    return FALSE;
+}
+
+/*
+ * Logs every name in one transaction: the metadata blocks are read once,
+ * all creates are applied to the in-memory copies, and each touched block
+ * is logged once as delta records before the single commit record. With
+ * --sync=group each name instead gets its own transaction, and all of them
+ * share one group commit.
+ */
+int journal_create(const char **filenames, int count) {
+    struct journal_header jh;
+    struct txn_buffer txn = { NULL, 0, 0 };
+    struct txn_changes changes = { NULL, 0, 0 };
+    
+    int created;
+    int failed;
+    int transactions;
+    int locked;
+    int ok;
+    int i;
+    
+    /* The server's threads each get the header under the commit lock */
+    if (serving == FALSE) {
+        if (read_journal_header(&jh) < 0) {
+            return FALSE;
+        }
+        meta_cache.jh = &jh;
+    } else {
+        memset(&jh, 0, sizeof(jh));
+    }
+    
+    /* Built without the lock; rebuilt when another writer got there first */
+    for (;;) {
+        created = 0;
+        failed = 0;
+        transactions = 0;
+        ok = TRUE;
+        changes.count = 0;
+        attempt_begin();
+        
+        for (i = 0; i < count && ok == TRUE; i++) {
+            if (apply_create(&meta_cache, &meta_dir, filenames[i], &changes) == TRUE) {
+                created++;
+                if (sync_mode == SYNC_GROUP) {
+                    ok = txn_note(&changes, NULL, 0, 0, CHANGE_COMMIT, 0);
+                    transactions++;
+                }
+            } else {
+                failed++;
+            }
+        }
+        
+        if (created == 0) {
+            attempt_end(TRUE);
+            free(changes.list);
+            return FALSE;
+        }
+        
+        if (sync_mode != SYNC_GROUP && ok == TRUE) {
+            ok = txn_note(&changes, NULL, 0, 0, CHANGE_COMMIT, 0);
+            transactions++;
+        }
+        
+        if (ok == FALSE) {
+            fprintf(output, "Error: Cannot allocate memory\n");
+            cache_discard();
+            attempt_end(TRUE);
+            free(changes.list);
+            return FALSE;
+        }
+        
+        locked = lock_for_commit(&meta_cache, &jh);
+        if (locked == TRUE) {
+            break;
+        }
+        if (locked < 0) {
+            cache_discard();
+            attempt_end(TRUE);
+            free(changes.list);
+            return FALSE;
+        }
+        unlock_journal();
+        cache_drop(&meta_cache, &meta_dir);
+        attempt_end(FALSE);
+    }
+    
+    ok = log_changes(&txn, &changes);
+    if (ok == FALSE) {
+        fprintf(output, "Error: Cannot allocate memory\n");
+    } else {
+        ok = append_transaction(&jh, &txn);
+    }
+    if (ok == FALSE) {
+        cache_discard();
+    }
+    unlock_journal();
+    free(changes.list);
+    free(txn.data);
+    if (ok == FALSE) {
+        attempt_end(TRUE);
+        return FALSE;
+    }
+    
+    if (count > 1) {
+        fprintf(output, "Logged %d file(s) in %d transaction(s)", created, transactions);
+        if (failed > 0) {
+            fprintf(output, ", %d failed", failed);
+        }
+        fprintf(output, ".\n");
+    }
+    fprintf(output, "Run './journal install' to apply changes to disk.\n");
+    attempt_end(TRUE);
+    
+    return (failed == 0) ? TRUE : FALSE;
+}
+
+/*
+ * Reads the whole source file for write, up to MAX_FILE_SIZE bytes, into
+ * a buffer of whole blocks with the tail of the last one zeroed. The
+ * caller frees *content.
+ */
+int read_source(const char *path, uint8_t **content, uint32_t *len) {
+    FILE *f;
+    uint8_t *grown;
+    size_t cap = 16 * BLOCK_SIZE;
+    size_t n = 0;
+    
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(output, "Error: Cannot open '%s'\n", path);
+        return FALSE;
+    }
+    *content = malloc(cap);
+    while (*content != NULL) {
+        n += fread(*content + n, 1, cap - n, f);
+        if (n < cap || ferror(f) || cap > MAX_FILE_SIZE) {
+            break;
+        }
+        grown = realloc(*content, cap * 2);
+        if (grown == NULL) {
+            free(*content);
+            *content = NULL;
+            break;
+        }
+        *content = grown;
+        cap *= 2;
+    }
+    if (*content == NULL) {
+        fprintf(output, "Error: Cannot allocate memory\n");
+        fclose(f);
+        return FALSE;
+    }
+    if (ferror(f)) {
+        fprintf(output, "Error: Cannot read '%s'\n", path);
+        fclose(f);
+        free(*content);
+        return FALSE;
+    }
+    fclose(f);
+    if (n > MAX_FILE_SIZE) {
+        fprintf(output, "Error: '%s' is too large (max %u bytes)\n", path, MAX_FILE_SIZE);
+        free(*content);
+        return FALSE;
+    }
+    /* cap is a whole number of blocks and n < cap */
+    memset(*content + n, 0, cap - n);
+    *len = (uint32_t)n;
+    return TRUE;
+}
+
+/*
+ * Replaces the contents of an existing file. The data goes to newly
+ * allocated blocks so a crash never leaves the old inode pointing at half
+ * written data. In ordered mode those blocks are written in place first
+ * and only the metadata (inode, data bitmap) is journaled; the barrier in
+ * front of the commit record keeps the data ahead of it on disk. With
+ * --data=journal, and for any block the log still holds an older image
+ * of (which install would otherwise write back over it), the data is
+ * logged in the transaction instead.
+ *
+ * Up to DIRECT_POINTERS blocks map through direct[]. A larger file gets
+ * an extent inode, its blocks allocated as the longest runs free space
+ * allows, and each run of in-place blocks is written with a single call.
+ */
+int journal_write(const char *filename, const char *src_path) {
+    struct journal_header jh;
+    struct txn_buffer txn = { NULL, 0, 0 };
+    struct extent extents[INODE_EXTENT_COUNT];
+    uint8_t *content;
+    uint32_t *block_nos = NULL;
+    uint8_t *in_place_at = NULL;    /* blocks written in place once the commit lock is held */
+    uint32_t len;
+    uint32_t nblocks = 0;
+    uint32_t nextents = 0;
+    uint32_t in_place = 0;
+    uint32_t i;
+    uint32_t j;
+    uint32_t n;
+    uint32_t run;
+    int e;
+    int locked;
+    int ok = FALSE;
+    uint8_t *block;
+    struct inode *root;
+    struct inode *ino;
+    struct dirent *de;
+    
+    if (read_source(src_path, &content, &len) == FALSE) {
+        return FALSE;
+    }
+    nblocks = vsfs_blocks(len);
+    if (data_mode == DATA_JOURNAL && (uint64_t)nblocks * sizeof(struct data_record) > journal_capacity()) {
+        fprintf(output, "Error: '%s' is too large to journal its data; use --data=ordered or resize the journal\n",
+                src_path);
+        free(content);
+        return FALSE;
+    }
+    block_nos = calloc(nblocks + 1, sizeof(uint32_t));
+    in_place_at = calloc(nblocks + 1, 1);
+    if (block_nos == NULL || in_place_at == NULL) {
+        fprintf(output, "Error: Cannot allocate memory\n");
+        free(block_nos);
+        free(in_place_at);
+        free(content);
+        return FALSE;
+    }
+    
+    if (read_journal_header(&jh) < 0) {
+        free(block_nos);
+        free(in_place_at);
+        free(content);
+        return FALSE;
+    }
+    meta_cache.jh = &jh;
+    
+retry:
+    attempt_begin();
+    root = get_inode(&meta_cache, 0);
+    if (root == NULL || (meta_dir.built == FALSE && dir_index_build(&meta_dir, &meta_cache, root) == FALSE)) {
+        fprintf(output, "Error: Cannot read root directory\n");
+        goto out;
+    }
+    e = dir_index_lookup(&meta_dir, &meta_cache, root, filename, name_hash(filename));
+    if (e < 0) {
+        fprintf(output, "Error: File '%s' not found\n", filename);
+        goto out;
+    }
+    de = dir_entry(&meta_cache, root, (uint32_t)e);
+    ino = (de != NULL) ? get_inode(&meta_cache, de->inode) : NULL;
+    if (ino == NULL) {
+        goto out;
+    }
+    if (ino->type != INODE_FILE) {
+        fprintf(output, "Error: '%s' is not a regular file\n", filename);
+        goto out;
+    }
+    
+    nblocks = vsfs_blocks(len);
+    if (nblocks <= DIRECT_POINTERS) {
+        for (i = 0; i < nblocks; i++) {
+            block_nos[i] = alloc_data_block(&meta_cache, NULL);
+            if (block_nos[i] == 0) {
+                fprintf(output, "Error: No free data blocks available\n");
+                goto out;
+            }
+        }
+    } else {
+        for (i = 0; i < nblocks; i += run) {
+            if (nextents == INODE_EXTENT_COUNT) {
+                fprintf(output, "Error: Free space is too fragmented to map '%s' in %u extents\n",
+                        filename, INODE_EXTENT_COUNT);
+                goto out;
+            }
+            extents[nextents].start = alloc_data_extent(&meta_cache, nblocks - i, &run);
+            if (extents[nextents].start == 0) {
+                fprintf(output, "Error: No free data blocks available\n");
+                goto out;
+            }
+            extents[nextents].length = run;
+            for (j = 0; j < run; j++) {
+                block_nos[i + j] = extents[nextents].start + j;
+            }
+            nextents++;
+        }
+    }
+    
+    for (i = 0; i < nblocks; i++) {
+        if (data_mode == DATA_ORDERED && block_in_journal(&jh, block_nos[i]) == FALSE) {
+            in_place_at[i] = TRUE;
+            in_place++;
+            continue;
+        }
+        block = cache_get(&meta_cache, block_nos[i]);
+        if (block == NULL) {
+            goto out;
+        }
+        memcpy(block, content + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    
+    free_file_blocks(&meta_cache, ino);
+    if (nextents > 0) {
+        ino->flags |= INODE_EXTENTS;
+        memcpy(ino->extents, extents, nextents * sizeof(struct extent));
+    } else {
+        for (i = 0; i < nblocks; i++) {
+            ino->direct[i] = block_nos[i];
+        }
+    }
+    ino->size = len;
+    ino->mtime = (uint32_t)time(NULL);
+    
+    if (log_transaction(&txn, &meta_cache) == FALSE) {
+        fprintf(output, "Error: Cannot allocate memory\n");
+        cache_drop(&meta_cache, &meta_dir);
+        goto out;
+    }
+    locked = lock_for_commit(&meta_cache, &jh);
+    if (locked < 0) {
+        cache_drop(&meta_cache, &meta_dir);
+        goto out;
+    }
+    if (locked == FALSE) {
+        unlock_journal();
+        cache_drop(&meta_cache, &meta_dir);
+        attempt_end(FALSE);
+        nextents = 0;
+        in_place = 0;
+        memset(block_nos, 0, nblocks * sizeof(uint32_t));
+        memset(in_place_at, 0, nblocks);
+        txn.len = 0;
+        goto retry;
+    }
+    
+    /*
+     * In-place data only goes out under the lock, once the blocks are known
+     * to be ours: a writer that loses a race never overwrites the winner's.
+     */
+    for (i = 0; i < nblocks; i = j) {
+        j = i + 1;
+        if (in_place_at[i] == FALSE) {
+            continue;
+        }
+        while (j < nblocks && in_place_at[j] && block_nos[j] == block_nos[j - 1] + 1) {
+            j++;
+        }
+        n = j - i;
+        if (write_blocks(block_nos[i], content + (size_t)i * BLOCK_SIZE, n) == FALSE) {
+            fprintf(output, "Error: Cannot write data blocks %u-%u\n", block_nos[i], block_nos[j - 1]);
+            unlock_journal();
+            cache_drop(&meta_cache, &meta_dir);
+            goto out;
+        }
+    }
+    /* The checksum covers the log, not data written in place */
+    if (in_place > 0 && sync_mode == SYNC_ASYNC && barrier() == FALSE) {
+        unlock_journal();
+        cache_drop(&meta_cache, &meta_dir);
+        goto out;
+    }
+    if (append_transaction(&jh, &txn) == FALSE) {
+        unlock_journal();
+        cache_drop(&meta_cache, &meta_dir);
+        goto out;
+    }
+    unlock_journal();
+    
+    fprintf(output, "Success: Wrote %u bytes to '%s' (%u block(s) in place, %u journaled)\n",
+            len, filename, in_place, nblocks - in_place);
+    fprintf(output, "Run './journal install' to apply changes to disk.\n");
+    ok = TRUE;
+    
+out:
+    cache_settle(&meta_cache, &meta_dir);
+    for (i = 0; i < nblocks; i++) {
+        if (block_nos[i] != 0 && in_place_at[i] == FALSE) {
+            cache_forget(&meta_cache, block_nos[i]);
+        }
+    }
+    attempt_end(TRUE);
+    free(txn.data);
+    free(block_nos);
+    free(in_place_at);
+    free(content);
+    return ok;
+}
+
+void free_batch_names(char **names, int count) {
+    int i;
+    
+    if (names == NULL) {
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+/*
+ * Collects names for create-batch: the remaining arguments, or one name
+ * per line from stdin when none are given. Each name is a copy; release
+ * them with free_batch_names().
+ */
+char **read_batch_names(int argc, char *argv[], int *count) {
+    char **names;
+    char line[256];
+    int capacity = 64;
+    int n = 0;
+    int i;
+    size_t len;
+    
+    if (argc > 0) {
+        names = malloc(argc * sizeof(char *));
+        if (names == NULL) {
+            return NULL;
+        }
+        for (i = 0; i < argc; i++) {
+            names[i] = strdup(argv[i]);
+            if (names[i] == NULL) {
+                free_batch_names(names, i);
+                return NULL;
+            }
+        }
+        *count = argc;
+        return names;
+    }
+    
+    names = malloc(capacity * sizeof(char *));
+    if (names == NULL) {
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        len = strcspn(line, "\r\n");
+        line[len] = '\0';
+        if (len == 0) continue;
+        if (n == capacity) {
+            char **grown;
+            capacity *= 2;
+            grown = realloc(names, capacity * sizeof(char *));
+            if (grown == NULL) {
+                break;
+            }
+            names = grown;
+        }
+        names[n] = strdup(line);
+        if (names[n] == NULL) {
+            break;
+        }
+        n++;
+    }
+    *count = n;
+    return names;
+}
+
+int replay_index_slot(struct replay_set *set, uint32_t block_no) {
+    int slot = (int)((block_no * 2654435761U) & (uint32_t)(set->index_cap - 1));
+    
+    while (set->index[slot] != 0 &&
+           set->writes[set->index[slot] - 1].block_no != block_no) {
+        slot = (slot + 1) & (set->index_cap - 1);
+    }
+    return slot;
+}
+
+/* Returns the write for block_no, adding an empty one when it is new */
+struct replay_write *replay_lookup(struct replay_set *set, uint32_t block_no) {
+    struct replay_write *w;
+    int slot;
+    int i;
+    
+    if (set->index_cap == 0 || (set->count + 1) * 2 > set->index_cap) {
+        int cap = set->index_cap ? set->index_cap * 2 : 64;
+        int *index = calloc(cap, sizeof(int));
+        if (index == NULL) {
+            return NULL;
+        }
+        free(set->index);
+        set->index = index;
+        set->index_cap = cap;
+        for (i = 0; i < set->count; i++) {
+            set->index[replay_index_slot(set, set->writes[i].block_no)] = i + 1;
+        }
+    }
+    
+    slot = replay_index_slot(set, block_no);
+    if (set->index[slot] != 0) {
+        return &set->writes[set->index[slot] - 1];
+    }
+    
+    if (set->count == set->cap) {
+        int cap = set->cap ? set->cap * 2 : 16;
+        struct replay_write *grown = realloc(set->writes, cap * sizeof(*grown));
+        if (grown == NULL) {
+            return NULL;
+        }
+        set->writes = grown;
+        set->cap = cap;
+    }
+    w = &set->writes[set->count++];
+    w->block_no = block_no;
+    w->data = NULL;
+    w->scratch = NULL;
+    set->index[slot] = set->count;
+    return w;
+}
+
+/* Returns the write for block_no, or NULL if the set has none */
+struct replay_write *replay_find(struct replay_set *set, uint32_t block_no) {
+    int slot;
+    
+    if (set->index_cap == 0) {
+        return NULL;
+    }
+    slot = replay_index_slot(set, block_no);
+    return (set->index[slot] != 0) ? &set->writes[set->index[slot] - 1] : NULL;
+}
+
+void replay_reset(struct replay_set *set) {
+    int i;
+    
+    for (i = 0; i < set->count; i++) {
+        pool_put(&block_pool, set->writes[i].scratch);
+    }
+    set->count = 0;
+    if (set->index != NULL) {
+        memset(set->index, 0, set->index_cap * sizeof(int));
+    }
+}
+
+/*
+ * Adds one DATA or DELTA record. A full image is written straight from the
+ * journal area; only a delta needs a private copy of the block to patch,
+ * taken from the newest image in base (earlier committed transactions) or
+ * else from the home location.
+ */
+int replay_record(struct replay_set *set, struct replay_set *base, const struct rec_header *rec) {
+    const struct delta_record *delta_rec;
+    struct replay_write *w;
+    struct replay_write *prev;
+    
+    w = replay_lookup(set, ((const struct data_record *)rec)->block_no);
+    if (w == NULL) {
+        return FALSE;
+    }
+    
+    if (rec->type == REC_DATA) {
+        w->data = ((const struct data_record *)rec)->data;
+        return TRUE;
+    }
+    
+    delta_rec = (const struct delta_record *)rec;
+    if (w->data == NULL || w->data != w->scratch) {
+        if (w->scratch == NULL) {
+            w->scratch = pool_get(&block_pool);
+            if (w->scratch == NULL) {
+                return FALSE;
+            }
+        }
+        prev = NULL;
+        if (w->data == NULL && base != NULL && base->count > 0) {
+            prev = replay_find(base, w->block_no);
+            if (prev != NULL && prev->data == NULL) {
+                prev = NULL;
+            }
+        }
+        if (w->data != NULL) {
+            memcpy(w->scratch, w->data, BLOCK_SIZE);
+        } else if (prev != NULL) {
+            memcpy(w->scratch, prev->data, BLOCK_SIZE);
+        } else if (read_block(w->block_no, w->scratch) == FALSE) {
+            return FALSE;
+        }
+        w->data = w->scratch;
+    }
+    memcpy(w->scratch + delta_rec->offset, delta_rec->data, delta_rec->length);
+    return TRUE;
+}
+
+/*
+ * Folds a committed transaction into the install set: the newest image of
+ * each block wins, and any private copies change owner.
+ */
+int replay_merge(struct replay_set *into, struct replay_set *from) {
+    struct replay_write *w;
+    int i;
+    
+    for (i = 0; i < from->count; i++) {
+        w = replay_lookup(into, from->writes[i].block_no);
+        if (w == NULL) {
+            return FALSE;
+        }
+        if (w->scratch != from->writes[i].scratch) {
+            pool_put(&block_pool, w->scratch);
+        }
+        w->data = from->writes[i].data;
+        w->scratch = from->writes[i].scratch;
+        from->writes[i].scratch = NULL;
+    }
+    replay_reset(from);
+    return TRUE;
+}
+
+int compare_replay_writes(const void *a, const void *b) {
+    uint32_t x = ((const struct replay_write *)a)->block_no;
+    uint32_t y = ((const struct replay_write *)b)->block_no;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Appends the byte runs each write is about to change to the manifest,
+ * with their current contents. It is made durable before the home
+ * locations are overwritten: if a crash cuts the install short, the
+ * replay that follows finds those bytes already updated and records
+ * nothing new for them.
+ */
+int record_changes(struct replay_set *set) {
+    uint8_t buffer[BLOCK_SIZE];
+    const uint8_t *home;
+    struct dirty_extent ext;
+    FILE *manifest;
+    int ok = TRUE;
+    int i;
+    uint32_t start;
+    uint32_t end;
+    uint32_t gap;
+    
+    manifest = fopen(DIRTY_MANIFEST, "ab");
+    if (manifest == NULL) {
+        fprintf(output, "Error: Cannot open %s\n", DIRTY_MANIFEST);
+        return FALSE;
+    }
+    
+    for (i = 0; i < set->count && ok == TRUE; i++) {
+        home = bdev_get(&disk, (uint64_t)set->writes[i].block_no * BLOCK_SIZE, buffer, BLOCK_SIZE);
+        if (home == NULL) {
+            fprintf(output, "Error: Cannot read block %u\n", set->writes[i].block_no);
+            ok = FALSE;
+            break;
+        }
+        start = 0;
+        while (start < BLOCK_SIZE) {
+            while (start < BLOCK_SIZE && home[start] == set->writes[i].data[start]) {
+                start++;
+            }
+            if (start == BLOCK_SIZE) {
+                break;
+            }
+            /* Extend the run until DIRTY_GAP equal bytes in a row */
+            end = start + 1;
+            gap = 0;
+            while (end + gap < BLOCK_SIZE && gap < DIRTY_GAP) {
+                if (home[end + gap] != set->writes[i].data[end + gap]) {
+                    end += gap + 1;
+                    gap = 0;
+                }
+                else {
+                    gap++;
+                }
+            }
+            ext.block_no = set->writes[i].block_no;
+            ext.offset = (uint16_t)start;
+            ext.length = (uint16_t)(end - start);
+            if (fwrite(&ext, sizeof(ext), 1, manifest) != 1 ||
+                fwrite(home + start, 1, end - start, manifest) != end - start) {
+                fprintf(output, "Error: Cannot write %s\n", DIRTY_MANIFEST);
+                ok = FALSE;
+                break;
+            }
+            start = end;
+        }
+    }
+    
+    if (fflush(manifest) != 0) {
+        fprintf(output, "Error: Cannot write %s\n", DIRTY_MANIFEST);
+        ok = FALSE;
+    }
+    if (ok == TRUE && sync_mode != SYNC_NONE && fdatasync(fileno(manifest)) != 0) {
+        fprintf(output, "Error: fdatasync failed\n");
+        ok = FALSE;
+    }
+    if (fclose(manifest) != 0 && ok == TRUE) {
+        fprintf(output, "Error: Cannot write %s\n", DIRTY_MANIFEST);
+        ok = FALSE;
+    }
+    return ok;
+}
+
+/*
+ * Writes every collected block in ascending block order. Each run of
+ * adjacent block numbers goes out as a single vectored write. The
+ * superblock, which only a resize logs, goes last and after a barrier:
+ * once it points at the new journal the old log is never read again, so
+ * the bitmap blocks that go with it must already be in place.
+ */
+int replay_flush(struct replay_set *set) {
+    struct iovec *iov;
+    struct bdev_request *reqs;
+    int nreqs = 0;
+    int first;
+    int ok = TRUE;
+    int i;
+    
+    qsort(set->writes, set->count, sizeof(struct replay_write), compare_replay_writes);
+    
+    if (set->count == 0) {
+        return TRUE;
+    }
+    /* Without the manifest entry an incremental check would miss the change */
+    if (record_changes(set) == FALSE) {
+        replay_reset(set);
+        return FALSE;
+    }
+    
+    /* All runs go down together; with --io=uring they are written in parallel */
+    iov = malloc(set->count * sizeof(*iov));
+    reqs = malloc(set->count * sizeof(*reqs));
+    if (iov == NULL || reqs == NULL) {
+        fprintf(output, "Error: Cannot allocate memory\n");
+        free(iov);
+        free(reqs);
+        replay_reset(set);
+        return FALSE;
+    }
+    first = (set->writes[0].block_no == 0) ? 1 : 0;
+    for (i = first; i < set->count; i++) {
+        iov[i].iov_base = (void *)set->writes[i].data;
+        iov[i].iov_len = BLOCK_SIZE;
+        if (i > first && set->writes[i].block_no == set->writes[i - 1].block_no + 1 &&
+            reqs[nreqs - 1].iovcnt < 64) {
+            reqs[nreqs - 1].iovcnt++;
+        } else {
+            reqs[nreqs].offset = (uint64_t)set->writes[i].block_no * BLOCK_SIZE;
+            reqs[nreqs].iov = &iov[i];
+            reqs[nreqs].iovcnt = 1;
+            nreqs++;
+        }
+    }
+    STAT_ADD(blocks_written, set->count);
+    STAT_ADD(blocks_installed, set->count);
+    if (nreqs > 0 && bdev_batch(&disk, TRUE, reqs, nreqs) < 0) {
+        fprintf(output, "Error: Cannot write blocks to their home locations\n");
+        ok = FALSE;
+    }
+    if (ok == TRUE && first == 1 &&
+        (barrier() == FALSE || bdev_write(&disk, 0, set->writes[0].data) < 0)) {
+        fprintf(output, "Error: Cannot write the superblock\n");
+        ok = FALSE;
+    }
+    
+    free(iov);
+    free(reqs);
+    replay_reset(set);
+    return ok;
+}
+
+void replay_free(struct replay_set *set) {
+    replay_reset(set);
+    free(set->writes);
+    free(set->index);
+    memset(set, 0, sizeof(*set));
+}
+
+/* Gives every write that still points into the journal area its own copy */
+int replay_own(struct replay_set *set) {
+    struct replay_write *w;
+    int i;
+    
+    for (i = 0; i < set->count; i++) {
+        w = &set->writes[i];
+        if (w->data != NULL && w->data != w->scratch) {
+            if (w->scratch == NULL) {
+                w->scratch = pool_get(&block_pool);
+                if (w->scratch == NULL) {
+                    return FALSE;
+                }
+            }
+            memcpy(w->scratch, w->data, BLOCK_SIZE);
+            w->data = w->scratch;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Cuts the log back to pos, where a transaction failed to verify: its
+ * commit never fully reached the disk (or was torn by a crash), so it and
+ * anything after it are dropped before new transactions are appended.
+ */
+int discard_torn(struct journal_header *jh, uint64_t pos, uint32_t txid, int records) {
+    struct journal_header now;
+    int ok = TRUE;
+    
+    if (lock_journal() == FALSE) {
+        return FALSE;
+    }
+    /* Only cut a log nobody else has appended to in the meantime */
+    if (read_journal_header(&now) < 0) {
+        unlock_journal();
+        return FALSE;
+    }
+    if (now.head == jh->head && now.tail <= pos) {
+        fprintf(output, "Warning: Discarding %d record(s) of an incomplete transaction at journal position %llu\n",
+                records, (unsigned long long)pos);
+        STAT_ADD(records_discarded, records);
+        jh->tail = now.tail;
+        jh->tail_txid = now.tail_txid;
+        jh->head = pos;
+        jh->head_txid = txid;
+        if (write_journal(0, jh, sizeof(*jh)) == FALSE || barrier() == FALSE) {
+            fprintf(output, "Error: Cannot update the journal header\n");
+            ok = FALSE;
+        }
+    }
+    /* Otherwise another process already cut it; the commit check sees that */
+    unlock_journal();
+    return ok;
+}
+
+/*
+ * Brings the overlay up to date with the log: built from the tail the
+ * first time, then extended only by transactions committed since. The
+ * images stay valid across checkpoints (the home blocks then hold the
+ * same data), and the overlay is emptied once the log is, or rebuilt from
+ * the new tail once it holds more than OVERLAY_MAX_BLOCKS, so a server
+ * that never empties the log does not keep every block it ever logged. Returns FALSE
+ * when it could not be updated; it is then rebuilt on the next call.
+ */
+int overlay_sync(struct journal_header *jh) {
+    const uint8_t *journal_data;
+    uint8_t *to_free;
+    const struct rec_header *rec;
+    struct replay_set txn = { NULL, 0, 0, NULL, 0 };
+    uint64_t pos;
+    uint64_t end = 0;
+    int records;
+    int ok = TRUE;
+    
+    if (jh->head == jh->tail) {
+        replay_reset(&overlay);
+        overlay_head = jh->head;
+        overlay_txid = jh->head_txid;
+        overlay_valid = TRUE;
+        return TRUE;
+    }
+    /* Past OVERLAY_MAX_BLOCKS, images a checkpoint installed are let go */
+    if (overlay_valid == FALSE || overlay_head < jh->tail || overlay_head > jh->head ||
+        (overlay.count > OVERLAY_MAX_BLOCKS && overlay_tail < jh->tail)) {
+        replay_reset(&overlay);
+        overlay_tail = jh->tail;
+        overlay_head = jh->tail;
+        overlay_txid = jh->tail_txid;
+    }
+    if (overlay_head == jh->head) {
+        overlay_valid = TRUE;
+        return TRUE;
+    }
+    
+    journal_data = get_journal_area(&to_free);
+    if (journal_data == NULL) {
+        overlay_valid = FALSE;
+        return FALSE;
+    }
+    
+    pos = overlay_head;
+    while (ok == TRUE && pos < jh->head) {
+        if (verify_transaction(journal_data, &pos, jh->head, overlay_txid, &end, &records) == FALSE) {
+            ok = discard_torn(jh, overlay_head, overlay_txid, records);
+            break;
+        }
+        while (ok == TRUE && (rec = next_record(journal_data, &pos, end)) != NULL) {
+            if (rec->type == REC_COMMIT) {
+                ok = replay_merge(&overlay, &txn);
+            } else {
+                ok = replay_record(&txn, &overlay, rec);
+            }
+            pos += rec->size;
+        }
+        overlay_head = end;
+        overlay_txid++;
+    }
+    if (ok == TRUE) {
+        ok = replay_own(&overlay);
+    }
+    
+    replay_free(&txn);
+    free(to_free);
+    overlay_valid = ok;
+    return ok;
+}
+
+/*
+ * Reads a block as the committed transactions still in the log leave it:
+ * the overlay's image when it has one, else the home location. A create
+ * therefore sees earlier creates that have not been installed yet.
+ */
+int read_block_logged(struct journal_header *jh, uint32_t block_no, uint8_t *buffer) {
+    struct replay_write *w;
+    
+    if (overlay_sync(jh) == FALSE) {
+        return FALSE;
+    }
+    w = replay_find(&overlay, block_no);
+    if (w != NULL && w->data != NULL) {
+        memcpy(buffer, w->data, BLOCK_SIZE);
+        return TRUE;
+    }
+    return read_block(block_no, buffer);
+}
+
+/*
+ * Returns TRUE when the log may still hold an image of block_no, which an
+ * install would write back over anything put there in place.
+ */
+int block_in_journal(struct journal_header *jh, uint32_t block_no) {
+    if (overlay_sync(jh) == FALSE) {
+        return TRUE;
+    }
+    return replay_find(&overlay, block_no) != NULL;
+}
+
+/*
+ * Installs up to max_transactions committed transactions (all when
+ * negative) from the tail of the log and moves the tail past them.
+ * Blocks are coalesced across transactions, so each distinct block is
+ * written once with its last committed image, in ascending block order.
+ * Replay stops at the first transaction that fails to verify (its commit
+ * is missing, torn or from an earlier pass over the log); the number of
+ * records it had is stored in *uncommitted. Returns the number of
+ * transactions installed, or -1 when a read, the install writes or the
+ * header update failed; the tail then stays where it was, so nothing
+ * committed is lost.
+ */
+int checkpoint_journal(struct journal_header *jh, int max_transactions, int *uncommitted) {
+    const uint8_t *journal_data;
+    uint8_t *to_free;
+    const struct rec_header *rec;
+    struct replay_set txn = { NULL, 0, 0, NULL, 0 };
+    struct replay_set set = { NULL, 0, 0, NULL, 0 };
+    
+    uint64_t pos;
+    uint64_t end;
+    uint64_t tail = jh->tail;
+    int transactions = 0;
+    int pending = 0;
+    int replayed;
+    int ok = TRUE;
+    
+    if (uncommitted != NULL) {
+        *uncommitted = 0;
+    }
+    if (jh->head == jh->tail) {
+        return 0;
+    }
+    
+    journal_data = get_journal_area(&to_free);
+    if (journal_data == NULL) {
+        return -1;
+    }
+    
+    pos = jh->tail;
+    
+    while (ok == TRUE && transactions != max_transactions && pos < jh->head) {
+        if (verify_transaction(journal_data, &pos, jh->head, jh->tail_txid + transactions,
+                               &end, &pending) == FALSE) {
+            break;
+        }
+        replayed = FALSE;
+        while ((rec = next_record(journal_data, &pos, end)) != NULL) {
+            if (rec->type == REC_DATA || rec->type == REC_DELTA) {
+                if (replay_record(&txn, &set, rec) == FALSE) {
+                    fprintf(output, "Error: Cannot replay record at journal position %llu\n",
+                            (unsigned long long)pos);
+                    ok = FALSE;
+                    break;
+                }
+                STAT_ADD(records_replayed, 1);
+            }
+            else {
+                if (replay_merge(&set, &txn) == FALSE) {
+                    fprintf(output, "Error: Cannot allocate memory\n");
+                    ok = FALSE;
+                    break;
+                }
+                replayed = TRUE;
+            }
+            pos += rec->size;
+        }
+        if (replayed == FALSE) {
+            break;
+        }
+        transactions++;
+        tail = end;
+    }
+    
+    if (uncommitted != NULL) {
+        *uncommitted = pending;
+    }
+    
+    if (ok == TRUE && transactions > 0) {
+        ok = replay_flush(&set);
+    }
+    replay_free(&txn);
+    replay_free(&set);
+    
+    /* The tail only moves once every block it covers is on disk */
+    if (ok == TRUE && transactions > 0) {
+        struct journal_header moved = *jh;
+        
+        moved.tail = tail;
+        moved.tail_txid += transactions;
+        if (barrier() == FALSE || write_journal(0, &moved, sizeof(moved)) == FALSE) {
+            fprintf(output, "Error: Cannot update the journal header\n");
+            ok = FALSE;
+        } else {
+            STAT_ADD(transactions_installed, transactions);
+            *jh = moved;
+        }
+    }
+    
+    free(to_free);
+    if (ok == FALSE) {
+        fprintf(output, "Error: Install failed; the journal still holds its transactions\n");
+        return -1;
+    }
+    return transactions;
+}
+
+int journal_install(void) {
+    struct journal_header jh;
+    int transactions;
+    int found;
+    
+    if (lock_journal() == FALSE) {
+        return FALSE;
+    }
+    found = read_journal_header(&jh);
+    if (found < 0) {
+        unlock_journal();
+        return FALSE;
+    }
+    if (found == FALSE) {
+        unlock_journal();
+        fprintf(output, "Journal is empty or uninitialized.\n");
+        return TRUE;
+    }
+    
+    if (jh.head == jh.tail) {
+        unlock_journal();
+        fprintf(output, "Journal is empty. Nothing to install.\n");
+        return TRUE;
+    }
+    
+    if (install_pending(&jh, &transactions) == FALSE) {
+        unlock_journal();
+        return FALSE;
+    }
+    unlock_journal();
+    
+    fprintf(output, "Success: Installed %d transaction(s) from journal.\n", transactions);
+    fprintf(output, "Journal has been cleared.\n");
+    
+    return TRUE;
+}
+
+/* Installs only the oldest transactions, freeing log space incrementally */
+int journal_checkpoint(int max_transactions) {
+    struct journal_header jh;
+    int transactions;
+    int found;
+    
+    if (lock_journal() == FALSE) {
+        return FALSE;
+    }
+    found = read_journal_header(&jh);
+    if (found < 0) {
+        unlock_journal();
+        return FALSE;
+    }
+    if (found == FALSE || jh.head == jh.tail) {
+        unlock_journal();
+        fprintf(output, "Journal is empty. Nothing to checkpoint.\n");
+        return TRUE;
+    }
+    
+    transactions = checkpoint_journal(&jh, max_transactions, NULL);
+    unlock_journal();
+    if (transactions < 0) {
+        return FALSE;
+    }
+    
+    fprintf(output, "Success: Checkpointed %d transaction(s); %llu journal bytes still in use.\n",
+            transactions, (unsigned long long)(jh.head - jh.tail));
+    
+    return TRUE;
+}
+
+/*
+ * Installs whatever the log holds and empties it. Only records past the
+ * last transaction that verified are dropped: a failed install keeps the
+ * whole log and returns FALSE. The number installed goes to *installed.
+ * The caller holds the commit lock.
+ */
+int install_pending(struct journal_header *jh, int *installed) {
+    int transactions;
+    int uncommitted;
+    
+    *installed = 0;
+    if (jh->head == jh->tail) {
+        return TRUE;
+    }
+    transactions = checkpoint_journal(jh, -1, &uncommitted);
+    if (transactions < 0) {
+        return FALSE;
+    }
+    *installed = transactions;
+    if (jh->head == jh->tail) {
+        return TRUE;
+    }
+    fprintf(output, "Warning: Discarding %d uncommitted writes\n", uncommitted);
+    STAT_ADD(records_discarded, uncommitted);
+    jh->head = jh->tail;
+    jh->head_txid = jh->tail_txid;
+    if (write_journal(0, jh, sizeof(*jh)) == FALSE || barrier() == FALSE) {
+        fprintf(output, "Error: Cannot update the journal header\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Completes a resize whose transaction has committed: installs the log,
+ * which ends with the superblock that moves or resizes the journal, clears
+ * the flag in the old header and loads the new superblock. The caller has
+ * the image to itself, so no other process still uses the old layout.
+ * With report set it says which of those happened, for a resize that was
+ * interrupted.
+ */
+int finish_resize(int report) {
+    struct journal_header jh;
+    struct superblock before = sb;
+    uint8_t block[BLOCK_SIZE];
+    int uncommitted;
+    int discarded = FALSE;
+    
+    if (lock_journal() == FALSE) {
+        return FALSE;
+    }
+    if (read_journal_header(&jh) < 0) {
+        unlock_journal();
+        return FALSE;
+    }
+    if (checkpoint_journal(&jh, -1, &uncommitted) < 0) {
+        /* The flag stays set, so the next open tries again */
+        unlock_journal();
+        return FALSE;
+    }
+    if (jh.head != jh.tail) {
+        /* Only a corrupt log gets here: the flag is written with the commit */
+        fprintf(output, "Warning: Discarding a journal resize whose transaction does not verify\n");
+        STAT_ADD(records_discarded, uncommitted);
+        jh.head = jh.tail;
+        jh.head_txid = jh.tail_txid;
+        discarded = TRUE;
+    }
+    jh.flags &= ~JOURNAL_RESIZING;
+    if (write_journal(0, &jh, sizeof(jh)) == FALSE || barrier() == FALSE) {
+        fprintf(output, "Error: Cannot update the journal header\n");
+        unlock_journal();
+        return FALSE;
+    }
+    unlock_journal();
+    
+    if (read_block(0, block) == FALSE) {
+        fprintf(output, "Error: Cannot read the superblock\n");
+        return FALSE;
+    }
+    memcpy(&sb, block, sizeof(sb));
+    replay_reset(&overlay);
+    overlay_valid = FALSE;
+    
+    if (report == FALSE) {
+        return TRUE;
+    }
+    if (discarded) {
+        fprintf(output, "The journal keeps its %u blocks at block %u.\n",
+                vsfs_journal_blocks(&sb), sb.journal_block);
+    } else if (sb.journal_block != before.journal_block) {
+        fprintf(output, "Finished an interrupted journal resize: moved to %u blocks at block %u.\n",
+                vsfs_journal_blocks(&sb), sb.journal_block);
+    } else {
+        fprintf(output, "Finished an interrupted journal resize: %u blocks in place at block %u.\n",
+                vsfs_journal_blocks(&sb), sb.journal_block);
+    }
+    return TRUE;
+}
+
+/* First run of count clear bits in [0, bits), or bits when there is none */
+uint32_t find_free_run(const uint8_t *bitmap, uint32_t bits, uint32_t count) {
+    uint32_t start = bitmap_find_zero(bitmap, 0, bits);
+    uint32_t used;
+    
+    while (start < bits && bits - start >= count) {
+        used = bitmap_find(bitmap, start, start + count, 1);
+        if (used == start + count) {
+            return start;
+        }
+        start = bitmap_find_zero(bitmap, used, bits);
+    }
+    return bits;
+}
+
+/*
+ * Gives the journal blocks blocks. The log is installed first, so only an
+ * empty journal moves. It stays in the blocks mkfs reserved while it fits
+ * there; a longer one grows in place in the data region when the blocks
+ * after it are free, or else moves to the first run of free data blocks.
+ * A new area gets an empty header first. Then one transaction through the
+ * old log carries the superblock and the data bitmap changes, flagged in
+ * the header, and is installed at once: a crash anywhere leaves either the
+ * old journal or the new one, and a committed move is finished on the next
+ * open.
+ */
+int journal_resize(uint32_t blocks) {
+    struct journal_header jh;
+    struct journal_header fresh;
+    struct superblock layout;
+    struct commit_record commit_rec;
+    struct txn_buffer txn = { NULL, 0, 0 };
+    uint8_t old_sb[BLOCK_SIZE];
+    uint8_t new_sb[BLOCK_SIZE];
+    uint8_t *orig = NULL;
+    uint8_t *bits = NULL;
+    uint32_t bmap_blocks = sb.inode_start - sb.data_bitmap;
+    uint32_t data_blocks = sb.total_blocks - sb.data_start;
+    uint32_t old_start = sb.journal_block;
+    uint32_t old_len = vsfs_journal_blocks(&sb);
+    uint32_t start;
+    uint32_t idx;
+    uint32_t b;
+    int transactions;
+    int ok = FALSE;
+    
+    if (lock_journal() == FALSE) {
+        return FALSE;
+    }
+    if (read_journal_header(&jh) < 0 || install_pending(&jh, &transactions) == FALSE) {
+        unlock_journal();
+        return FALSE;
+    }
+    if (transactions > 0) {
+        fprintf(output, "Installed %d transaction(s) from journal.\n", transactions);
+    }
+    
+    orig = malloc((size_t)bmap_blocks * BLOCK_SIZE);
+    bits = malloc((size_t)bmap_blocks * BLOCK_SIZE);
+    if (orig == NULL || bits == NULL) {
+        fprintf(output, "Error: Cannot allocate memory\n");
+        goto done;
+    }
+    for (b = 0; b < bmap_blocks; b++) {
+        if (read_block(sb.data_bitmap + b, orig + (size_t)b * BLOCK_SIZE) == FALSE) {
+            fprintf(output, "Error: Cannot read the data bitmap\n");
+            goto done;
+        }
+    }
+    
+    if (blocks <= sb.inode_bitmap - JOURNAL_BLOCK_IDX) {
+        start = JOURNAL_BLOCK_IDX;
+    } else if (old_start >= sb.data_start &&
+               (blocks <= old_len ||
+                ((uint64_t)old_start - sb.data_start + blocks <= data_blocks &&
+                 bitmap_range_clear(orig, old_start - sb.data_start + old_len,
+                                    old_start - sb.data_start + blocks)))) {
+        start = old_start;
+    } else {
+        idx = find_free_run(orig, data_blocks, blocks);
+        if (idx == data_blocks) {
+            fprintf(output, "Error: No run of %u free data blocks can hold the journal\n", blocks);
+            goto done;
+        }
+        start = sb.data_start + idx;
+    }
+    if (start == old_start && blocks == old_len) {
+        fprintf(output, "Journal already has %u blocks.\n", blocks);
+        ok = TRUE;
+        goto done;
+    }
+    
+    /* The data bitmap marks a journal in the data region used */
+    memcpy(bits, orig, (size_t)bmap_blocks * BLOCK_SIZE);
+    if (old_start >= sb.data_start) {
+        for (b = 0; b < old_len; b++) {
+            bitmap_clear(bits, old_start - sb.data_start + b);
+        }
+    }
+    if (start >= sb.data_start) {
+        for (b = 0; b < blocks; b++) {
+            bitmap_set(bits, start - sb.data_start + b);
+        }
+    }
+    
+    if (read_block(0, old_sb) == FALSE) {
+        fprintf(output, "Error: Cannot read the superblock\n");
+        goto done;
+    }
+    memcpy(&layout, old_sb, sizeof(layout));
+    layout.journal_block = start;
+    layout.journal_blocks = blocks;
+    memcpy(new_sb, old_sb, BLOCK_SIZE);
+    memcpy(new_sb, &layout, sizeof(layout));
+    
+    if (log_block(&txn, 0, old_sb, new_sb) == FALSE) {
+        fprintf(output, "Error: Cannot allocate memory\n");
+        goto done;
+    }
+    for (b = 0; b < bmap_blocks; b++) {
+        if (memcmp(orig + (size_t)b * BLOCK_SIZE, bits + (size_t)b * BLOCK_SIZE, BLOCK_SIZE) != 0 &&
+            log_block(&txn, sb.data_bitmap + b, orig + (size_t)b * BLOCK_SIZE,
+                      bits + (size_t)b * BLOCK_SIZE) == FALSE) {
+            fprintf(output, "Error: Cannot allocate memory\n");
+            goto done;
+        }
+    }
+    commit_rec.hdr.type = REC_COMMIT;
+    commit_rec.hdr.size = sizeof(struct commit_record);
+    commit_rec.txid = 0;    /* numbered and checksummed by append_transaction */
+    commit_rec.crc = 0;
+    if (txn_append(&txn, &commit_rec, sizeof(commit_rec)) == FALSE) {
+        fprintf(output, "Error: Cannot allocate memory\n");
+        goto done;
+    }
+    
+    /* A new area must hold an empty log before the superblock can point at it */
+    if (start != old_start) {
+        memset(new_sb, 0, BLOCK_SIZE);
+        fresh.magic = JOURNAL_MAGIC;
+        fresh.flags = 0;
+        fresh.head = 0;
+        fresh.tail = 0;
+        fresh.head_txid = jh.head_txid + 1;
+        fresh.tail_txid = jh.head_txid + 1;
+        memcpy(new_sb, &fresh, sizeof(fresh));
+        if (write_block(start, new_sb) == FALSE || barrier() == FALSE) {
+            fprintf(output, "Error: Cannot write the new journal header\n");
+            goto done;
+        }
+    }
+    
+    jh.flags |= JOURNAL_RESIZING;
+    if (append_transaction(&jh, &txn) == FALSE) {
+        goto done;
+    }
+    unlock_journal();
+    free(txn.data);
+    free(orig);
+    free(bits);
+    
+    if (finish_resize(FALSE) == FALSE) {
+        return FALSE;
+    }
+    fprintf(output, "Success: Journal resized from %u to %u blocks, now at block %u.\n",
+            old_len, vsfs_journal_blocks(&sb), sb.journal_block);
+    return TRUE;
+    
+done:
+    unlock_journal();
+    free(txn.data);
+    free(orig);
+    free(bits);
+    return ok;
+}
+
+/*
+ * Coalesces the committed transactions from the tail of the log into set,
+ * the way checkpoint_journal() would install them, up to but not
+ * including transaction stop. Replay also ends at the head or at a
+ * transaction that fails to verify; *reached is the txid it stopped at.
+ */
+int replay_until(const uint8_t *journal_data, struct journal_header *jh, uint32_t stop,
+                 struct replay_set *set, uint32_t *reached) {
+    const struct rec_header *rec;
+    struct replay_set txn = { NULL, 0, 0, NULL, 0 };
+    uint64_t pos = jh->tail;
+    uint64_t end;
+    uint32_t txid = jh->tail_txid;
+    int ok = TRUE;
+    
+    while (ok == TRUE && txid != stop && pos < jh->head &&
+           verify_transaction(journal_data, &pos, jh->head, txid, &end, NULL) == TRUE) {
+        while (ok == TRUE && (rec = next_record(journal_data, &pos, end)) != NULL) {
+            if (rec->type == REC_COMMIT) {
+                ok = replay_merge(set, &txn);
+            } else {
+                ok = replay_record(&txn, set, rec);
+            }
+            pos += rec->size;
+        }
+        txid++;
+    }
+    replay_free(&txn);
+    *reached = txid;
+    if (ok == FALSE) {
+        fprintf(output, "Error: Cannot allocate memory\n");
+    }
+    return ok;
+}
+
+/* Adds the data blocks a file maps to set, without images */
+int add_file_blocks(struct replay_set *set, const struct inode *ino) {
+    uint32_t start;
+    uint32_t b;
+    uint32_t i;
+    
+    if (ino->type != INODE_FILE) {
+        return TRUE;
+    }
+    if (ino->flags & INODE_EXTENTS) {
+        for (i = 0; i < INODE_EXTENT_COUNT && ino->extents[i].length != 0; i++) {
+            start = ino->extents[i].start;
+            if (start < sb.data_start || start >= sb.total_blocks ||
+                ino->extents[i].length > sb.total_blocks - start) {
+                continue;
+            }
+            for (b = start; b < start + ino->extents[i].length; b++) {
+                if (replay_lookup(set, b) == NULL) {
+                    return FALSE;
+                }
+            }
+        }
+        return TRUE;
+    }
+    for (i = 0; i < DIRECT_POINTERS; i++) {
+        b = ino->direct[i];
+        if (b >= sb.data_start && b < sb.total_blocks && replay_lookup(set, b) == NULL) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Writes part of an export stream and adds it to the stream's checksum */
+int stream_write(FILE *stream, const void *data, uint32_t size, uint32_t *crc, uint64_t *bytes) {
+    *crc = crc32c(*crc, data, size);
+    *bytes += size;
+    return fwrite(data, 1, size, stream) == size;
+}
+
+/*
+ * Streams the transactions committed from from_txid (the tail unless
+ * given) to the head, coalesced the way install would write them: each
+ * block changed since from_txid once, as delta records against its image
+ * at from_txid. Ordered-mode data never passes through the log, so every
+ * block of a file whose inode changed is sent whole from its home
+ * location. The commit lock is held throughout, so nothing commits or
+ * installs while the stream is written.
+ */
+int journal_export(const char *path, int from_given, uint32_t from) {
+    struct journal_header jh;
+    struct stream_header hdr;
+    struct commit_record commit_rec;
+    struct data_record data_rec;
+    struct replay_set base = { NULL, 0, 0, NULL, 0 };
+    struct replay_set final = { NULL, 0, 0, NULL, 0 };
+    struct replay_set files = { NULL, 0, 0, NULL, 0 };
+    struct replay_write *sorted = NULL;
+    struct replay_write *prev;
+    struct txn_buffer txn = { NULL, 0, 0 };
+    const uint8_t *journal_data = NULL;
+    const uint8_t *orig;
+    uint8_t *to_free = NULL;
+    uint8_t home[BLOCK_SIZE];
+    FILE *stream = NULL;
+    uint64_t bytes = 0;
+    uint32_t crc = 0;
+    uint32_t end;
+    uint32_t reached;
+    uint32_t b;
+    uint32_t slot;
+    int blocks = 0;
+    int i;
+    int ok = FALSE;
+    
+    if (lock_journal() == FALSE) {
+        return FALSE;
+    }
+    if (read_journal_header(&jh) < 0) {
+        goto done;
+    }
+    end = jh.tail_txid;
+    if (jh.head != jh.tail) {
+        journal_data = get_journal_area(&to_free);
+        if (journal_data == NULL || replay_until(journal_data, &jh, jh.head_txid, &final, &end) == FALSE) {
+            goto done;
+        }
+    }
+    if (from_given == FALSE) {
+        from = jh.tail_txid;
+    }
+    if (from < jh.tail_txid) {
+        fprintf(output, "Error: Transactions before %u are already installed; copy the whole image instead\n",
+                jh.tail_txid);
+        goto done;
+    }
+    if (from > end) {
+        fprintf(output, "Error: Transaction %u is not in the journal, which ends at %u\n", from, end);
+        goto done;
+    }
+    if (from > jh.tail_txid && replay_until(journal_data, &jh, from, &base, &reached) == FALSE) {
+        goto done;
     }
     
-    if (open_disk() == FALSE) {
-        return 1;
+    /* A sorted copy, so final keeps its index for the lookups below */
+    sorted = malloc((final.count + 1) * sizeof(*sorted));
+    if (sorted == NULL) {
+        fprintf(output, "Error: Cannot allocate memory\n");
+        goto done;
+    }
+    memcpy(sorted, final.writes, final.count * sizeof(*sorted));
+    qsort(sorted, final.count, sizeof(*sorted), compare_replay_writes);
+    
+    stream = (path != NULL) ? fopen(path, "wb") : stdout;
+    if (stream == NULL) {
+        fprintf(output, "Error: Cannot create '%s'\n", path);
+        goto done;
+    }
+    
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = STREAM_MAGIC;
+    hdr.block_size = BLOCK_SIZE;
+    hdr.from_txid = from;
+    hdr.end_txid = end;
+    hdr.layout = sb;
+    if (stream_write(stream, &hdr, sizeof(hdr), &crc, &bytes) == FALSE) {
+        goto write_error;
+    }
+    
+    for (i = 0; i < final.count; i++) {
+        b = sorted[i].block_no;
+        prev = replay_find(&base, b);
+        if (prev != NULL && prev->data != NULL) {
+            orig = prev->data;
+        } else if (read_block(b, home) == TRUE) {
+            orig = home;
+        } else {
+            fprintf(output, "Error: Cannot read block %u\n", b);
+            goto done;
+        }
+        txn.len = 0;
+        if (log_block(&txn, b, orig, sorted[i].data) == FALSE) {
+            fprintf(output, "Error: Cannot allocate memory\n");
+            goto done;
+        }
+        if (txn.len == 0) {
+            continue;
+        }
+        blocks++;
+        if (stream_write(stream, txn.data, txn.len, &crc, &bytes) == FALSE) {
+            goto write_error;
+        }
+        if (b < sb.inode_start || b >= sb.data_start) {
+            continue;
+        }
+        for (slot = 0; slot < INODES_PER_BLOCK; slot++) {
+            if (memcmp(orig + slot * INODE_SIZE, sorted[i].data + slot * INODE_SIZE, INODE_SIZE) != 0 &&
+                add_file_blocks(&files, (const struct inode *)(sorted[i].data + slot * INODE_SIZE)) == FALSE) {
+                fprintf(output, "Error: Cannot allocate memory\n");
+                goto done;
+            }
+        }
+    }
+    
+    /* File data the log does not hold comes from the home locations */
+    qsort(files.writes, files.count, sizeof(struct replay_write), compare_replay_writes);
+    data_rec.hdr.type = REC_DATA;
+    data_rec.hdr.size = sizeof(struct data_record);
+    for (i = 0; i < files.count; i++) {
+        b = files.writes[i].block_no;
+        if (replay_find(&final, b) != NULL) {
+            continue;
+        }
+        data_rec.block_no = b;
+        if (read_block(b, data_rec.data) == FALSE) {
+            fprintf(output, "Error: Cannot read block %u\n", b);
+            goto done;
+        }
+        blocks++;
+        if (stream_write(stream, &data_rec, sizeof(data_rec), &crc, &bytes) == FALSE) {
+            goto write_error;
+        }
+    }
+    
+    commit_rec.hdr.type = REC_COMMIT;
+    commit_rec.hdr.size = sizeof(struct commit_record);
+    commit_rec.txid = end;
+    commit_rec.crc = crc32c(crc, &commit_rec, offsetof(struct commit_record, crc));
+    bytes += sizeof(commit_rec);
+    if (fwrite(&commit_rec, sizeof(commit_rec), 1, stream) != 1 || fflush(stream) != 0) {
+        goto write_error;
+    }
+    
+    fprintf(output, "Success: Exported %u transaction(s) from %u: %d block(s) in %llu bytes.\n",
+            end - from, from, blocks, (unsigned long long)bytes);
+    ok = TRUE;
+    goto done;
+    
+write_error:
+    fprintf(output, "Error: Cannot write the stream\n");
+done:
+    unlock_journal();
+    if (stream != NULL && stream != stdout && fclose(stream) != 0 && ok == TRUE) {
+        fprintf(output, "Error: Cannot write the stream\n");
+        ok = FALSE;
+    }
+    replay_free(&base);
+    replay_free(&final);
+    replay_free(&files);
+    free(sorted);
+    free(txn.data);
+    free(to_free);
+    return ok;
+}
+
+/* Reads a whole export stream from path, or stdin when path is NULL */
+uint8_t *read_stream(const char *path, uint64_t *len) {
+    FILE *in = (path != NULL) ? fopen(path, "rb") : stdin;
+    uint8_t *data = NULL;
+    uint8_t *grown;
+    size_t cap = 0;
+    size_t n;
+    
+    if (in == NULL) {
+        fprintf(output, "Error: Cannot open '%s'\n", path);
+        return NULL;
+    }
+    *len = 0;
+    do {
+        if (*len == cap) {
+            cap = cap ? cap * 2 : (size_t)64 * BLOCK_SIZE;
+            grown = realloc(data, cap);
+            if (grown == NULL) {
+                fprintf(output, "Error: Cannot allocate memory\n");
+                free(data);
+                data = NULL;
+                break;
+            }
+            data = grown;
+        }
+        n = fread(data + *len, 1, cap - *len, in);
+        *len += n;
+    } while (n > 0);
+    if (data != NULL && ferror(in)) {
+        fprintf(output, "Error: Cannot read the stream\n");
+        free(data);
+        data = NULL;
+    }
+    if (in != stdin) {
+        fclose(in);
+    }
+    return data;
+}
+
+/*
+ * Checks a stream before anything is written: its header and layout, that
+ * every record is well formed and writes a block outside the superblock
+ * and journal, and that it ends in a commit record whose checksum matches.
+ */
+int verify_stream(const uint8_t *data, uint64_t len) {
+    const struct stream_header *hdr = (const struct stream_header *)data;
+    const struct rec_header *rec;
+    const struct commit_record *commit;
+    const struct delta_record *delta_rec;
+    uint64_t pos = sizeof(*hdr);
+    uint32_t crc;
+    uint32_t block_no;
+    
+    if (len < sizeof(*hdr) || hdr->magic != STREAM_MAGIC) {
+        fprintf(output, "Error: Not an export stream\n");
+        return FALSE;
+    }
+    if (hdr->block_size != BLOCK_SIZE) {
+        fprintf(output, "Error: The stream has %u-byte blocks; this journal was built for %u\n",
+                hdr->block_size, BLOCK_SIZE);
+        return FALSE;
+    }
+    if (memcmp(&hdr->layout, &sb, sizeof(sb)) != 0) {
+        fprintf(output, "Error: The stream comes from an image with a different layout\n");
+        return FALSE;
+    }
+    
+    crc = crc32c(0, hdr, sizeof(*hdr));
+    while (hdr->from_txid <= hdr->end_txid && len - pos >= sizeof(struct rec_header)) {
+        rec = (const struct rec_header *)(data + pos);
+        if (rec->size < sizeof(struct rec_header) || rec->size > len - pos || (rec->size & 3) != 0) {
+            break;
+        }
+        if (rec->type == REC_COMMIT) {
+            commit = (const struct commit_record *)rec;
+            crc = crc32c(crc, rec, offsetof(struct commit_record, crc));
+            if (rec->size == sizeof(*commit) && commit->txid == hdr->end_txid &&
+                commit->crc == crc && pos + rec->size == len) {
+                return TRUE;
+            }
+            break;
+        }
+        if (rec->type == REC_DELTA) {
+            delta_rec = (const struct delta_record *)rec;
+            if (rec->size < sizeof(*delta_rec) + delta_rec->length ||
+                delta_rec->offset + delta_rec->length > BLOCK_SIZE) {
+                break;
+            }
+        } else if (rec->type != REC_DATA || rec->size != sizeof(struct data_record)) {
+            break;
+        }
+        block_no = ((const struct data_record *)rec)->block_no;
+        if (block_no == 0 || block_no >= sb.total_blocks ||
+            (block_no >= sb.journal_block && block_no - sb.journal_block < vsfs_journal_blocks(&sb))) {
+            fprintf(output, "Error: The stream writes block %u, outside the metadata and data regions\n",
+                    block_no);
+            return FALSE;
+        }
+        crc = crc32c(crc, rec, rec->size);
+        pos += rec->size;
+    }
+    fprintf(output, "Error: The stream is truncated or corrupt at byte %llu\n", (unsigned long long)pos);
+    return FALSE;
+}
+
+/*
+ * Brings this image from the stream's first transaction to its last. The
+ * image's own log is installed first; its tail txid is then where it
+ * stands, and must be where the stream starts. The blocks go out through
+ * the install path, dirty manifest included, and the header then moves
+ * both txids to the end. A delta record holds the new bytes rather than a
+ * difference, so applying the same stream again after a crash is safe.
+ */
+int journal_apply_stream(const char *path) {
+    struct journal_header jh;
+    const struct stream_header *hdr;
+    const struct rec_header *rec;
+    struct replay_set set = { NULL, 0, 0, NULL, 0 };
+    uint8_t *data;
+    uint64_t len;
+    uint64_t pos;
+    int blocks;
+    int transactions;
+    int ok = FALSE;
+    
+    data = read_stream(path, &len);
+    if (data == NULL) {
+        return FALSE;
+    }
+    if (verify_stream(data, len) == FALSE) {
+        free(data);
+        return FALSE;
+    }
+    hdr = (const struct stream_header *)data;
+    
+    if (lock_journal() == FALSE) {
+        free(data);
+        return FALSE;
+    }
+    if (read_journal_header(&jh) < 0 || install_pending(&jh, &transactions) == FALSE) {
+        goto done;
+    }
+    if (transactions > 0) {
+        fprintf(output, "Installed %d transaction(s) from journal.\n", transactions);
+    }
+    if (jh.tail_txid != hdr->from_txid) {
+        if (jh.tail_txid == hdr->end_txid) {
+            fprintf(output, "Image is already at transaction %u. Nothing to apply.\n", jh.tail_txid);
+            ok = TRUE;
+        } else if (jh.tail_txid > hdr->from_txid && jh.tail_txid < hdr->end_txid) {
+            fprintf(output, "Error: The stream starts at transaction %u, but the image is at %u; export with --from=%u\n",
+                    hdr->from_txid, jh.tail_txid, jh.tail_txid);
+        } else {
+            fprintf(output, "Error: The stream starts at transaction %u, but the image is at %u\n",
+                    hdr->from_txid, jh.tail_txid);
+        }
+        goto done;
+    }
+    
+    pos = sizeof(*hdr);
+    for (rec = (const struct rec_header *)(data + pos); rec->type != REC_COMMIT;
+         rec = (const struct rec_header *)(data + pos)) {
+        if (replay_record(&set, NULL, rec) == FALSE) {
+            fprintf(output, "Error: Cannot replay record at stream byte %llu\n", (unsigned long long)pos);
+            goto done;
+        }
+        STAT_ADD(records_replayed, 1);
+        pos += rec->size;
+    }
+    blocks = set.count;
+    if (replay_flush(&set) == FALSE || barrier() == FALSE) {
+        goto done;
+    }
+    
+    jh.tail_txid = hdr->end_txid;
+    jh.head_txid = hdr->end_txid;
+    if (write_journal(0, &jh, sizeof(jh)) == FALSE || barrier() == FALSE) {
+        fprintf(output, "Error: Cannot update the journal header\n");
+        goto done;
+    }
+    fprintf(output, "Success: Applied transactions %u to %u (%d block(s)); the image is now at transaction %u.\n",
+            hdr->from_txid, hdr->end_txid, blocks, hdr->end_txid);
+    ok = TRUE;
+    
+done:
+    unlock_journal();
+    replay_free(&set);
+    free(data);
+    return ok;
+}
+
+/* Consumes leading --options; returns FALSE on an unknown one */
+int parse_options(int *argc, char ***argv) {
+    char *prog = (*argv)[0];
+    
+    while (*argc > 1 && strncmp((*argv)[1], "--", 2) == 0) {
+        const char *opt = (*argv)[1];
+        
+        if (strcmp(opt, "--sync=none") == 0) {
+            sync_mode = SYNC_NONE;
+        } else if (strcmp(opt, "--sync=commit") == 0) {
+            sync_mode = SYNC_COMMIT;
+        } else if (strcmp(opt, "--sync=group") == 0) {
+            sync_mode = SYNC_GROUP;
+        } else if (strcmp(opt, "--sync=async") == 0) {
+            sync_mode = SYNC_ASYNC;
+        } else if (strcmp(opt, "--data=ordered") == 0) {
+            data_mode = DATA_ORDERED;
+        } else if (strcmp(opt, "--data=journal") == 0) {
+            data_mode = DATA_JOURNAL;
+        } else if (strncmp(opt, "--connect=", 10) == 0) {
+            connect_path = opt + 10;
+        } else if (strcmp(opt, "--connect") == 0) {
+            connect_path = SOCKET_PATH;
+        } else if (strcmp(opt, "--io=mmap") == 0) {
+            io_flags = (io_flags & ~BDEV_URING) | BDEV_MMAP;
+        } else if (strcmp(opt, "--io=pread") == 0) {
+            io_flags &= ~(BDEV_MMAP | BDEV_URING);
+        } else if (strcmp(opt, "--io=uring") == 0) {
+            io_flags = (io_flags & ~BDEV_MMAP) | BDEV_URING;
+        } else if (strcmp(opt, "--direct") == 0) {
+            io_flags |= BDEV_DIRECT;
+        } else if (strcmp(opt, "--stats") == 0) {
+            show_stats = TRUE;
+        } else {
+            fprintf(output, "Error: Unknown option '%s'\n", opt);
+            return FALSE;
+        }
+        (*argc)--;
+        (*argv)++;
+    }
+    (*argv)[0] = prog;
+    return TRUE;
+}
+
+/* Parses a decimal argument in [min, max]: digits only, nothing after them */
+int parse_number(const char *text, unsigned long min, unsigned long max, unsigned long *value) {
+    char *end;
+    
+    if (text == NULL || *text < '0' || *text > '9') {
+        return FALSE;
     }
+    errno = 0;
+    *value = strtoul(text, &end, 10);
+    return (errno == 0 && *end == '\0' && *value >= min && *value <= max) ? TRUE : FALSE;
+}
+
+/* Runs one command; argv[0] is the command name */
+int run_command(int argc, char *argv[]) {
+    int result;
     
-    if (strcmp(argv[1], "create") == 0) {
+    if (strcmp(argv[0], "create") == 0) {
+        if (argc < 2) {
+            fprintf(output, "Error: Missing filename\n");
+            result = FALSE;
+        } else {
+            result = journal_create((const char **)&argv[1], 1);
+        }
+    }
+    else if (strcmp(argv[0], "create-batch") == 0) {
+        char **names;
+        int count = 0;
+        
+        names = (serving && argc < 2) ? NULL : read_batch_names(argc - 1, &argv[1], &count);
+        if (names == NULL || count == 0) {
+            fprintf(output, "Error: Missing filename\n");
+            result = FALSE;
+        } else {
+            result = journal_create((const char **)names, count);
+        }
+        free_batch_names(names, count);
+    }
+    else if (strcmp(argv[0], "write") == 0) {
         if (argc < 3) {
-            printf("Error: Missing filename\n");
+            fprintf(output, "Error: Missing filename or source file\n");
             result = FALSE;
         } else {
-            result = journal_create(argv[2]);
+            result = journal_write(argv[1], argv[2]);
         }
     }
-    else if (strcmp(argv[1], "install") == 0) {
+    else if (strcmp(argv[0], "install") == 0) {
         result = journal_install();
     }
+    else if (strcmp(argv[0], "stats") == 0) {
+        if (serving == FALSE || show_stats == FALSE) {
+            fprintf(output, "Error: 'stats' reports the counters of a server started with --stats\n");
+            result = FALSE;
+        } else {
+            print_stats(output, "serve");
+            result = TRUE;
+        }
+    }
+    else if (strcmp(argv[0], "resize") == 0) {
+        unsigned long blocks;
+        
+        if (serving) {
+            fprintf(output, "Error: 'resize' needs the image to itself; stop the server first\n");
+            result = FALSE;
+        } else if (parse_number((argc > 1) ? argv[1] : NULL, 1, UINT32_MAX / BLOCK_SIZE, &blocks) == FALSE) {
+            fprintf(output, "Error: Invalid journal length '%s'\n", (argc > 1) ? argv[1] : "");
+            result = FALSE;
+        } else {
+            result = journal_resize((uint32_t)blocks);
+        }
+    }
+    else if (strcmp(argv[0], "export") == 0) {
+        const char *path = NULL;
+        unsigned long from = 0;
+        int from_given = FALSE;
+        int i;
+        
+        result = TRUE;
+        for (i = 1; i < argc; i++) {
+            if (strncmp(argv[i], "--from=", 7) == 0) {
+                from_given = TRUE;
+                if (parse_number(argv[i] + 7, 0, UINT32_MAX, &from) == FALSE) {
+                    fprintf(output, "Error: Invalid transaction '%s'\n", argv[i] + 7);
+                    result = FALSE;
+                }
+            } else if (strcmp(argv[i], "-") != 0) {
+                path = argv[i];
+            }
+        }
+        if (result == TRUE && path == NULL && serving) {
+            fprintf(output, "Error: 'export' on a server needs a file to write the stream to\n");
+            result = FALSE;
+        }
+        if (result == TRUE) {
+            if (path == NULL) {
+                output = stderr;    /* stdout carries the stream */
+            }
+            result = journal_export(path, from_given, (uint32_t)from);
+        }
+    }
+    else if (strcmp(argv[0], "apply-stream") == 0) {
+        const char *path = (argc > 1 && strcmp(argv[1], "-") != 0) ? argv[1] : NULL;
+        
+        if (serving) {
+            fprintf(output, "Error: 'apply-stream' needs the image to itself; stop the server first\n");
+            result = FALSE;
+        } else {
+            result = journal_apply_stream(path);
+        }
+    }
+    else if (strcmp(argv[0], "checkpoint") == 0) {
+        unsigned long count = 1;
+        
+        if (argc > 1 && parse_number(argv[1], 1, INT_MAX, &count) == FALSE) {
+            fprintf(output, "Error: Invalid transaction count '%s'\n", argv[1]);
+            result = FALSE;
+        } else {
+            result = journal_checkpoint((int)count);
+        }
+    }
     else {
-        printf("Error: Unknown command '%s'\n", argv[1]);
+        fprintf(output, "Error: Unknown command '%s'\n", argv[0]);
         result = FALSE;
     }
     
+    
+    return result;
+}
+
+/*
+ * Splits a request line into whitespace-separated words in place. The
+ * argument array grows as needed and is reused between requests.
+ */
+int split_args(char *line, char ***args, int *cap) {
+    int n = 0;
+    char *word;
+    
+    for (word = strtok(line, " \t\r\n"); word != NULL; word = strtok(NULL, " \t\r\n")) {
+        if (n == *cap) {
+            int grown_cap = *cap ? *cap * 2 : 16;
+            char **grown = realloc(*args, grown_cap * sizeof(char *));
+            if (grown == NULL) {
+                return -1;
+            }
+            *args = grown;
+            *cap = grown_cap;
+        }
+        (*args)[n++] = word;
+    }
+    return n;
+}
+
+/*
+ * Takes the server's command lock for a request. Creates share it and run
+ * in parallel, each under its own thread's name; anything else has the
+ * server to itself. A cache a failed commit left stale is dropped first,
+ * and one grown past CACHE_MAX_BLOCKS is trimmed back, a create then
+ * running alone for it.
+ */
+void begin_command(const char *name) {
+    if (meta_stale == 0 && __atomic_load_n(&meta_cache.count, __ATOMIC_RELAXED) <= CACHE_MAX_BLOCKS &&
+        (strcmp(name, "create") == 0 || strcmp(name, "create-batch") == 0)) {
+        pthread_rwlock_rdlock(&command_lock);
+        return;
+    }
+    pthread_rwlock_wrlock(&command_lock);
+    if (meta_stale) {
+        cache_drop(&meta_cache, &meta_dir);
+        meta_stale = 0;
+    } else {
+        cache_trim(&meta_cache, CACHE_MAX_BLOCKS);
+    }
+}
+
+/*
+ * Answers requests from one client, one command line each. Everything the
+ * command prints goes back to the client, followed by a "= <status>" line
+ * with the exit status the one-shot command would have had.
+ */
+void serve_client(int fd) {
+    FILE *in;
+    char *line = NULL;
+    size_t line_cap = 0;
+    char **args = NULL;
+    int args_cap = 0;
+    int nargs;
+    int result;
+    
+    in = fdopen(dup(fd), "r");
+    output = fdopen(dup(fd), "w");
+    if (in == NULL || output == NULL) {
+        if (in != NULL) fclose(in);
+        if (output != NULL) fclose(output);
+        return;
+    }
+    
+    while (stop_serving == 0 && getline(&line, &line_cap, in) > 0) {
+        nargs = split_args(line, &args, &args_cap);
+        if (nargs == 0) continue;
+        if (nargs < 0) {
+            dprintf(fd, "Error: Cannot allocate memory\n= 1\n");
+            continue;
+        }
+        if (strcmp(args[0], "shutdown") == 0) {
+            stop_serving = 1;
+            shutdown(listen_fd, SHUT_RD);   /* wakes accept() */
+            dprintf(fd, "Server shutting down.\n= 0\n");
+            break;
+        }
+        
+        begin_command(args[0]);
+        result = run_command(nargs, args);
+        pthread_rwlock_unlock(&command_lock);
+        fflush(output);
+        
+        dprintf(fd, "= %d\n", (result == TRUE) ? 0 : 1);
+    }
+    
+    free(args);
+    free(line);
+    fclose(output);
+    fclose(in);
+}
+
+/*
+ * One thread per client. Each slot keeps its own allocation hints across
+ * connections, starting in its own region of the bitmaps a whole number
+ * of inode blocks apart, so creates from parallel clients rarely meet on
+ * a bitmap byte or an inode table block.
+ */
+void *client_thread(void *arg) {
+    int slot = (int)(intptr_t)arg;
+    uint32_t inode_region = (sb.inode_count / ALLOC_REGIONS) & ~(uint32_t)(INODES_PER_BLOCK - 1);
+    uint32_t data_region = ((sb.total_blocks - sb.data_start) / ALLOC_REGIONS) & ~7U;
+    int fd;
+    
+    pthread_mutex_lock(&client_lock);
+    fd = client_fds[slot] - 1;
+    if (client_hints[slot].set == FALSE) {
+        client_hints[slot].inode = (uint32_t)(slot % ALLOC_REGIONS) * inode_region;
+        client_hints[slot].data = (uint32_t)(slot % ALLOC_REGIONS) * data_region;
+        client_hints[slot].set = TRUE;
+    }
+    inode_hint = client_hints[slot].inode;
+    data_hint = client_hints[slot].data;
+    pthread_mutex_unlock(&client_lock);
+    
+    serve_client(fd);
+    
+    pthread_mutex_lock(&client_lock);
+    client_hints[slot].inode = inode_hint;
+    client_hints[slot].data = data_hint;
+    client_fds[slot] = 0;
+    clients--;
+    pthread_cond_signal(&client_done);
+    pthread_mutex_unlock(&client_lock);
+    close(fd);
+    return NULL;
+}
+
+void handle_stop(int sig) {
+    (void)sig;
+    stop_serving = 1;
+}
+
+/*
+ * Keeps the image open and the metadata cache warm, and runs the commands
+ * clients send over a Unix socket until told to shut down. The journal
+ * stays the source of truth: each request commits exactly as the one-shot
+ * command would, so a crash of the server loses nothing that was
+ * acknowledged.
+ */
+int journal_serve(const char *path) {
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    sigset_t stop_signals;
+    sigset_t saved;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int cfd;
+    int slot;
+    
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(output, "Error: Socket path too long\n");
+        return FALSE;
+    }
+    
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        fprintf(output, "Error: Cannot create socket\n");
+        return FALSE;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 16) < 0) {
+        fprintf(output, "Error: Cannot listen on %s\n", path);
+        close(listen_fd);
+        return FALSE;
+    }
+    
+    /* No SA_RESTART, so a signal interrupts accept() and ends the loop */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    serving = TRUE;
+    
+    /* Client threads leave the signals to this one */
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    
+    fprintf(output, "Serving %s on %s\n", DISK_IMAGE, path);
+    fflush(output);
+    
+    while (stop_serving == 0) {
+        pthread_mutex_lock(&client_lock);
+        while (clients == MAX_CLIENTS) {
+            pthread_cond_wait(&client_done, &client_lock);
+        }
+        pthread_mutex_unlock(&client_lock);
+        
+        cfd = accept(listen_fd, NULL, NULL);
+        if (cfd < 0) {
+            if (errno == EINTR || stop_serving) continue;
+            fprintf(output, "Error: accept failed\n");
+            break;
+        }
+        
+        pthread_mutex_lock(&client_lock);
+        for (slot = 0; client_fds[slot] != 0; slot++) ;
+        client_fds[slot] = cfd + 1;
+        clients++;
+        pthread_mutex_unlock(&client_lock);
+        
+        pthread_sigmask(SIG_BLOCK, &stop_signals, &saved);
+        if (pthread_create(&thread, &attr, client_thread, (void *)(intptr_t)slot) != 0) {
+            pthread_mutex_lock(&client_lock);
+            client_fds[slot] = 0;
+            clients--;
+            pthread_mutex_unlock(&client_lock);
+            close(cfd);
+        }
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    }
+    
+    /* Idle clients see end of input; running commands finish first */
+    pthread_mutex_lock(&client_lock);
+    for (slot = 0; slot < MAX_CLIENTS; slot++) {
+        if (client_fds[slot] != 0) {
+            shutdown(client_fds[slot] - 1, SHUT_RD);
+        }
+    }
+    while (clients > 0) {
+        pthread_cond_wait(&client_done, &client_lock);
+    }
+    pthread_mutex_unlock(&client_lock);
+    pthread_attr_destroy(&attr);
+    
+    close(listen_fd);
+    unlink(path);
+    fprintf(output, "Server stopped.\n");
+    return TRUE;
+}
+
+int write_all(int fd, const char *buf, size_t len) {
+    ssize_t n;
+    
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return FALSE;
+        buf += n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+/*
+ * Sends one command to a running server and prints its reply. Returns the
+ * command's exit status, or 1 when the server cannot be reached.
+ */
+int journal_connect(const char *path, int argc, char *argv[]) {
+    struct sockaddr_un addr;
+    FILE *in;
+    char *line = NULL;
+    size_t line_cap = 0;
+    char **words;
+    char **names = NULL;
+    int nnames = 0;
+    int nwords = argc;
+    int status = 1;
+    int fd;
+    int i;
+    
+    words = argv;
+    if (strcmp(argv[0], "create-batch") == 0 && argc == 1) {
+        names = read_batch_names(0, NULL, &nnames);
+        words = (names != NULL) ? malloc((nnames + 1) * sizeof(char *)) : NULL;
+        if (words == NULL) {
+            fprintf(output, "Error: Cannot allocate memory\n");
+            free_batch_names(names, nnames);
+            return 1;
+        }
+        words[0] = argv[0];
+        for (i = 0; i < nnames; i++) {
+            words[i + 1] = names[i];
+        }
+        nwords = nnames + 1;
+    }
+    
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(output, "Error: Cannot connect to server at %s\n", path);
+        if (fd >= 0) close(fd);
+        goto done;
+    }
+    
+    for (i = 0; i < nwords; i++) {
+        if (write_all(fd, (i > 0) ? " " : "", (i > 0) ? 1 : 0) == FALSE ||
+            write_all(fd, words[i], strlen(words[i])) == FALSE) {
+            break;
+        }
+    }
+    if (i < nwords || write_all(fd, "\n", 1) == FALSE) {
+        fprintf(output, "Error: Cannot send request\n");
+        close(fd);
+        goto done;
+    }
+    
+    in = fdopen(fd, "r");
+    while (in != NULL && getline(&line, &line_cap, in) > 0) {
+        if (line[0] == '=' && line[1] == ' ') {
+            status = atoi(line + 2);
+            break;
+        }
+        fputs(line, output);
+    }
+    
+    free(line);
+    if (in != NULL) fclose(in); else close(fd);
+    
+done:
+    if (words != argv) free(words);
+    free_batch_names(names, nnames);
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    int result;
+    
+    output = stdout;
+    start_ns = now_ns();
+    if (parse_options(&argc, &argv) == FALSE) {
+        return 1;
+    }
+    
+    if (argc < 2) {
+        fprintf(output, "Usage:\n");
+        fprintf(output, "  %s [--sync=none|commit|group|async] [--data=ordered|journal] [--io=mmap|pread|uring] [--direct] [--stats] <command>\n", argv[0]);
+        fprintf(output, "  %s create <filename>\n", argv[0]);
+        fprintf(output, "  %s create-batch [filename...]   (names from stdin if none given)\n", argv[0]);
+        fprintf(output, "  %s write <filename> <source>\n", argv[0]);
+        fprintf(output, "  %s install\n", argv[0]);
+        fprintf(output, "  %s checkpoint [count]\n", argv[0]);
+        fprintf(output, "  %s resize <blocks>              (install, then move or grow the journal)\n", argv[0]);
+        fprintf(output, "  %s export [--from=txid] [file]  (stream committed transactions; stdout if no file)\n", argv[0]);
+        fprintf(output, "  %s apply-stream [file]          (bring this image up to date from an export; stdin if no file)\n", argv[0]);
+        fprintf(output, "  %s stats                        (on a server started with --stats)\n", argv[0]);
+        fprintf(output, "  %s serve [socket]               (default %s)\n", argv[0], SOCKET_PATH);
+        fprintf(output, "  %s --connect[=socket] <command>  (run a command on the server; 'shutdown' stops it)\n", argv[0]);
+        return 1;
+    }
+    
+    if (connect_path != NULL) {
+        return journal_connect(connect_path, argc - 1, &argv[1]);
+    }
+    
+    if (open_disk(strcmp(argv[1], "serve") == 0 || strcmp(argv[1], "resize") == 0 ||
+                  strcmp(argv[1], "apply-stream") == 0) == FALSE) {
+        return 1;
+    }
+    
+    if (strcmp(argv[1], "serve") == 0) {
+        result = journal_serve((argc > 2) ? argv[2] : SOCKET_PATH);
+    } else {
+        result = run_command(argc - 1, &argv[1]);
+    }
+    
     close_disk();
+    if (show_stats) {
+        fflush(output);
+        print_stats(stderr, argv[1]);
+    }
     
     return (result == TRUE) ? 0 : 1;
 }
@@ -7,130 +7,218 @@
 #include <time.h>
 #include <unistd.h>
 
-#define FS_MAGIC 0x56534653U
-
-#define BLOCK_SIZE        4096U
-#define INODE_SIZE         128U
-#define JOURNAL_BLOCK_IDX    1U
-#define JOURNAL_BLOCKS      16U
-#define INODE_BLOCKS         2U
-#define DATA_BLOCKS         64U
-#define INODE_BMAP_IDX     (JOURNAL_BLOCK_IDX + JOURNAL_BLOCKS)
-#define DATA_BMAP_IDX      (INODE_BMAP_IDX + 1U)
-#define INODE_START_IDX    (DATA_BMAP_IDX + 1U)
-#define DATA_START_IDX     (INODE_START_IDX + INODE_BLOCKS)
-#define TOTAL_BLOCKS       (DATA_START_IDX + DATA_BLOCKS)
+#include "bitmap.h"
+#include "blockdev.h"
+#include "vsfs.h"
+
+#define DEFAULT_JOURNAL_BLOCKS 16U
+#define DEFAULT_INODES       64U
+#define DEFAULT_DATA_BLOCKS  64U
+#define MAX_JOURNAL_BLOCKS (UINT32_MAX / BLOCK_SIZE)
 #define DEFAULT_IMAGE "vsfs.img"
 
-struct superblock {
-    uint32_t magic;
-    uint32_t block_size;
-    uint32_t total_blocks;
-    uint32_t inode_count;
-
-    uint32_t journal_block;
-    uint32_t inode_bitmap;
-    uint32_t data_bitmap;
-    uint32_t inode_start;
-    uint32_t data_start;
-
-    uint8_t  _pad[128 - 9 * 4];
+/* How the blocks mkfs leaves zeroed get onto the disk */
+enum alloc_mode {
+    ALLOC_SPARSE,   /* size the image with ftruncate and leave holes */
+    ALLOC_PREALLOC, /* reserve every block with posix_fallocate */
+    ALLOC_FULL,     /* write every block, as on a device without holes */
 };
 
-struct inode {
-    uint16_t type;
-    uint16_t links;
-    uint32_t size;
-
-    uint32_t direct[8];
-
-    uint32_t ctime;
-    uint32_t mtime;
+static void die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
 
-    uint8_t _pad[128 - (2 + 2 + 4 + 8 * 4 + 4 + 4)];
-};
+static void write_block(struct blockdev *bd, uint32_t index, const void *block) {
+    if (bdev_write(bd, index, block) < 0) {
+        die("write");
+    }
+}
 
-struct dirent {
-    uint32_t inode;
-    char name[28];
-};
+static void write_zero_blocks(struct blockdev *bd, uint32_t start, uint32_t end) {
+    static const uint8_t zero[BLOCK_SIZE];
+    for (uint32_t i = start; i < end; ++i) {
+        write_block(bd, i, zero);
+    }
+}
 
-_Static_assert(sizeof(struct superblock) == 128, "superblock must be 128 bytes");
-_Static_assert(sizeof(struct inode) == 128, "inode must be 128 bytes");
-_Static_assert(sizeof(struct dirent) == 32, "dirent must be 32 bytes");
+static uint32_t div_round_up(uint64_t n, uint32_t d) {
+    return (uint32_t)((n + d - 1) / d);
+}
 
-static void die(const char *msg) {
-    perror(msg);
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-b total_blocks] [-i inodes] [-j journal_blocks]\n"
+                    "       [-a sparse|prealloc|full] [-L] [image]\n", prog);
     exit(EXIT_FAILURE);
 }
 
-static void write_block(int fd, const void *block) {
-    ssize_t written = write(fd, block, BLOCK_SIZE);
-    if (written != (ssize_t)BLOCK_SIZE) {
-        die("write");
+static uint32_t parse_count(const char *arg, const char *prog) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(arg, &end, 0);
+    if (errno != 0 || *end != '\0' || v == 0 || v > UINT32_MAX) {
+        usage(prog);
     }
+    return (uint32_t)v;
 }
 
-static void set_bitmap(uint8_t *bitmap, uint32_t index) {
-    bitmap[index / 8] |= (uint8_t)(1U << (index % 8));
+/*
+ * Lays out the regions in order: superblock, journal, inode bitmap, data
+ * bitmap, inode table, data. Bitmaps and the inode table span as many
+ * blocks as the counts need, and the data bitmap is sized to the data
+ * region left over. With total_blocks == 0 the image gets
+ * DEFAULT_DATA_BLOCKS data blocks.
+ */
+static int compute_layout(struct superblock *sb, uint32_t total_blocks,
+                          uint32_t inodes, uint32_t journal_blocks) {
+    uint32_t inode_blocks = div_round_up(inodes, INODES_PER_BLOCK);
+    uint32_t inode_bmap_blocks = div_round_up((uint64_t)inode_blocks * INODES_PER_BLOCK, BITS_PER_BLOCK);
+    uint64_t fixed = 1ULL + journal_blocks + inode_bmap_blocks + inode_blocks;
+
+    if (total_blocks == 0) {
+        uint64_t total = fixed + 1 + DEFAULT_DATA_BLOCKS;
+        if (total > UINT32_MAX) {
+            return -1;
+        }
+        total_blocks = (uint32_t)total;
+    }
+
+    uint32_t data_bmap_blocks = 1;
+    for (;;) {
+        if ((uint64_t)total_blocks <= fixed + data_bmap_blocks) {
+            return -1;
+        }
+        uint32_t data_blocks = (uint32_t)(total_blocks - fixed - data_bmap_blocks);
+        if (data_blocks <= (uint64_t)data_bmap_blocks * BITS_PER_BLOCK) {
+            break;
+        }
+        data_bmap_blocks = div_round_up(data_blocks, BITS_PER_BLOCK);
+    }
+
+    sb->magic = FS_MAGIC;
+    sb->block_size = BLOCK_SIZE;
+    sb->total_blocks = total_blocks;
+    sb->inode_count = inode_blocks * INODES_PER_BLOCK;
+    sb->journal_block = JOURNAL_BLOCK_IDX;
+    sb->journal_blocks = journal_blocks;
+    sb->inode_bitmap = JOURNAL_BLOCK_IDX + journal_blocks;
+    sb->data_bitmap = sb->inode_bitmap + inode_bmap_blocks;
+    sb->inode_start = sb->data_bitmap + data_bmap_blocks;
+    sb->data_start = sb->inode_start + inode_blocks;
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
-    const char *image_path = (argc > 1) ? argv[1] : DEFAULT_IMAGE;
+    uint32_t total_blocks = 0;
+    uint32_t inodes = DEFAULT_INODES;
+    uint32_t journal_blocks = DEFAULT_JOURNAL_BLOCKS;
+    enum alloc_mode mode = ALLOC_SPARSE;
+    int lazy_itable = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:i:j:a:L")) != -1) {
+        switch (opt) {
+        case 'b':
+            total_blocks = parse_count(optarg, argv[0]);
+            break;
+        case 'i':
+            inodes = parse_count(optarg, argv[0]);
+            break;
+        case 'j':
+            journal_blocks = parse_count(optarg, argv[0]);
+            break;
+        case 'a':
+            if (strcmp(optarg, "sparse") == 0) {
+                mode = ALLOC_SPARSE;
+            } else if (strcmp(optarg, "prealloc") == 0) {
+                mode = ALLOC_PREALLOC;
+            } else if (strcmp(optarg, "full") == 0) {
+                mode = ALLOC_FULL;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'L':
+            lazy_itable = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind > 1) {
+        usage(argv[0]);
+    }
+    const char *image_path = (optind < argc) ? argv[optind] : DEFAULT_IMAGE;
+
+    if (journal_blocks > MAX_JOURNAL_BLOCKS || inodes > UINT32_MAX - INODES_PER_BLOCK) {
+        fprintf(stderr, "journal or inode count too large\n");
+        return EXIT_FAILURE;
+    }
+
+    struct superblock sb = {0};
+    if (compute_layout(&sb, total_blocks, inodes, journal_blocks) < 0) {
+        fprintf(stderr, "%u blocks cannot hold a %u-block journal and %u inodes\n",
+                total_blocks, journal_blocks, inodes);
+        return EXIT_FAILURE;
+    }
 
-    int fd = open(image_path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
-    if (fd < 0) {
+    struct blockdev bd;
+    if (bdev_open(&bd, image_path, BDEV_CREATE, BLOCK_SIZE) < 0) {
         die("open");
     }
 
+    /*
+     * The image is freshly truncated, so every block reads as zero until
+     * written. Outside full mode only blocks with content are written and
+     * the rest is sized (or reserved) in one call.
+     */
+    uint64_t image_size = (uint64_t)sb.total_blocks * BLOCK_SIZE;
+    if (mode == ALLOC_SPARSE && bdev_resize(&bd, image_size) < 0) {
+        die("ftruncate");
+    }
+    if (mode == ALLOC_PREALLOC && bdev_allocate(&bd, image_size) < 0) {
+        die("fallocate");
+    }
+
     uint8_t block[BLOCK_SIZE];
     memset(block, 0, sizeof(block));
 
-    struct superblock sb = {
-        .magic = FS_MAGIC,
-        .block_size = BLOCK_SIZE,
-        .total_blocks = TOTAL_BLOCKS,
-        .inode_count = INODE_BLOCKS * (BLOCK_SIZE / INODE_SIZE),
-        .journal_block = JOURNAL_BLOCK_IDX,
-        .inode_bitmap = INODE_BMAP_IDX,
-        .data_bitmap = DATA_BMAP_IDX,
-        .inode_start = INODE_START_IDX,
-        .data_start = DATA_START_IDX,
-    };
-
     memcpy(block, &sb, sizeof(sb));
-    write_block(fd, block); // Superblock
+    write_block(&bd, 0, block); // Superblock
 
-    memset(block, 0, sizeof(block));
-    for (uint32_t i = 0; i < JOURNAL_BLOCKS; ++i) {
-        write_block(fd, block); // Journal blocks
+    if (mode == ALLOC_FULL) {
+        write_zero_blocks(&bd, sb.journal_block, sb.inode_bitmap); // Journal blocks
     }
 
     memset(block, 0, sizeof(block));
-    set_bitmap(block, 0); // Reserve inode 0 for root
-    write_block(fd, block); // Inode bitmap
+    bitmap_set(block, 0); // Reserve inode 0 for root
+    write_block(&bd, sb.inode_bitmap, block); // Inode bitmap
+    write_zero_blocks(&bd, sb.inode_bitmap + 1, sb.data_bitmap);
 
     memset(block, 0, sizeof(block));
-    set_bitmap(block, 0); // Reserve first data block for root directory
-    write_block(fd, block); // Data bitmap
+    bitmap_set(block, 0); // Reserve first data block for root directory
+    write_block(&bd, sb.data_bitmap, block); // Data bitmap
+    write_zero_blocks(&bd, sb.data_bitmap + 1, sb.inode_start);
 
     time_t now = time(NULL);
 
     struct inode root = {0};
-    root.type = 2; // directory
+    root.type = INODE_DIR;
     root.links = 2; // "." and ".."
     root.size = 2 * sizeof(struct dirent);
     memset(root.direct, 0, sizeof(root.direct));
-    root.direct[0] = DATA_START_IDX;
+    root.direct[0] = sb.data_start;
     root.ctime = (uint32_t)now;
     root.mtime = (uint32_t)now;
 
     memset(block, 0, sizeof(block));
     memcpy(block, &root, sizeof(root));
-    write_block(fd, block); // First inode block
+    write_block(&bd, sb.inode_start, block); // First inode block
 
-    memset(block, 0, sizeof(block));
-    write_block(fd, block); // Second inode block
+    // Like ext4's lazy_itable_init, -L leaves the rest of the table to read as zero
+    if (!lazy_itable || mode == ALLOC_FULL) {
+        write_zero_blocks(&bd, sb.inode_start + 1, sb.data_start); // Remaining inode blocks
+    }
 
     memset(block, 0, sizeof(block));
     struct dirent *root_dirents = (struct dirent *)block;
@@ -140,17 +228,27 @@ int main(int argc, char *argv[]) {
     root_dirents[1].inode = 0;
     strncpy(root_dirents[1].name, "..", sizeof(root_dirents[1].name) - 1);
     root_dirents[1].name[sizeof(root_dirents[1].name) - 1] = '\0';
-    write_block(fd, block); // First data block holds root directory entries
+    write_block(&bd, sb.data_start, block); // First data block holds root directory entries
 
-    memset(block, 0, sizeof(block));
-    for (uint32_t i = 1; i < DATA_BLOCKS; ++i) {
-        write_block(fd, block);
+    if (mode == ALLOC_FULL) {
+        write_zero_blocks(&bd, sb.data_start + 1, sb.total_blocks);
     }
 
-    if (close(fd) < 0) {
+    if (bdev_close(&bd) < 0) {
         die("close");
     }
 
-    printf("Created VSFS image '%s' (%u blocks).\n", image_path, TOTAL_BLOCKS);
+    /* A fresh image is its own baseline: start an empty dirty-block manifest */
+    char manifest[4096];
+    if (snprintf(manifest, sizeof(manifest), "%s.dirty", image_path) < (int)sizeof(manifest)) {
+        int fd = open(manifest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            die("open manifest");
+        }
+        close(fd);
+    }
+
+    printf("Created VSFS image '%s' (%u blocks, %u inodes, %u journal blocks).\n",
+           image_path, sb.total_blocks, sb.inode_count, sb.inode_bitmap - sb.journal_block);
     return 0;
 }
@@ -0,0 +1,187 @@
+/*
+ * vsfs.h - On-disk format shared by mkfs, journal, validator and bench
+ *
+ * The block size is fixed at compile time (VSFS_BLOCK_SIZE, 4096 unless
+ * built with -DVSFS_BLOCK_SIZE=1024 or 65536), so every per-block count
+ * below is a power-of-two constant and the lookups at the end compile to
+ * shifts and masks. Everything else about an image's layout (where each
+ * region starts, how many inodes and blocks it has) is read from the
+ * superblock at run time, and a tool refuses an image whose block_size
+ * is not the one it was built for.
+ *
+ * Include after blockdev.h, which clears the kernel's BLOCK_SIZE.
+ */
+#ifndef VSFS_FORMAT_H
+#define VSFS_FORMAT_H
+
+#include <stdint.h>
+
+#ifndef VSFS_BLOCK_SIZE
+#define VSFS_BLOCK_SIZE 4096
+#endif
+#if VSFS_BLOCK_SIZE != 1024 && VSFS_BLOCK_SIZE != 4096 && VSFS_BLOCK_SIZE != 65536
+#error "VSFS_BLOCK_SIZE must be 1024, 4096 or 65536"
+#endif
+
+#define FS_MAGIC          0x56534653U   /* "VSFS" */
+#define JOURNAL_MAGIC     0x4A524E32U   /* "JRN2": commit records carry txid and CRC32C */
+
+#define BLOCK_SIZE        ((uint32_t)VSFS_BLOCK_SIZE)
+#define INODE_SIZE        128U
+#define DIRENT_SIZE       32U
+#define NAME_LEN          28U           /* including the terminating NUL */
+#define DIRECT_POINTERS   8U
+#define INODES_PER_BLOCK  (BLOCK_SIZE / INODE_SIZE)
+#define DIRENTS_PER_BLOCK (BLOCK_SIZE / DIRENT_SIZE)
+#define BITS_PER_BLOCK    (BLOCK_SIZE * 8U)
+
+#define JOURNAL_BLOCK_IDX 1U            /* mkfs puts the journal after the superblock */
+#define ROOT_INODE        0U
+
+/* inode.type */
+#define INODE_FREE        0
+#define INODE_FILE        1
+#define INODE_DIR         2
+
+/* inode.flags */
+#define INODE_EXTENTS     0x1U          /* data mapped by extents[]; direct[] is all zero */
+
+#define INODE_EXTENT_COUNT 9U
+
+/* Block 0; the rest of the block is zero */
+struct superblock {
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t total_blocks;
+    uint32_t inode_count;
+
+    uint32_t journal_block;
+    uint32_t inode_bitmap;
+    uint32_t data_bitmap;
+    uint32_t inode_start;
+    uint32_t data_start;
+    uint32_t journal_blocks;    /* 0 on images from before it: up to inode_bitmap */
+
+    uint8_t  _pad[128 - 10 * 4];
+};
+
+/* A run of consecutive blocks of a file, in file order */
+struct extent {
+    uint32_t start;
+    uint32_t length;            /* 0 ends the list */
+};
+
+/*
+ * A file's blocks are either direct[] (one pointer per block, at most
+ * DIRECT_POINTERS) or, with INODE_EXTENTS, up to INODE_EXTENT_COUNT
+ * extents. Directories always use direct[]. Older images have zeros past
+ * mtime, so all their inodes read as direct.
+ */
+struct inode {
+    uint16_t type;
+    uint16_t links;
+    uint32_t size;
+
+    uint32_t direct[DIRECT_POINTERS];
+
+    uint32_t ctime;
+    uint32_t mtime;
+
+    uint32_t flags;
+    struct extent extents[INODE_EXTENT_COUNT];
+
+    uint8_t _pad[INODE_SIZE - (2 + 2 + 4 + DIRECT_POINTERS * 4 + 4 + 4 + 4 + INODE_EXTENT_COUNT * 8)];
+};
+
+struct dirent {
+    uint32_t inode;
+    char name[NAME_LEN];
+};
+
+/*
+ * First bytes of the journal area. The log is circular. head and tail are
+ * logical byte positions that only grow; a position maps to
+ * LOG_START + pos % capacity inside the journal area. [tail, head) holds
+ * committed, not yet installed records. Transactions are numbered;
+ * head_txid goes to the next one appended and tail_txid is the one at the
+ * tail. An all-zero header is an empty journal that was never written.
+ */
+struct journal_header {
+    uint32_t magic;
+    uint32_t flags;             /* JOURNAL_RESIZING */
+    uint64_t head;
+    uint64_t tail;
+    uint32_t head_txid;
+    uint32_t tail_txid;
+};
+
+/*
+ * The last transaction in the log moves the journal: its superblock points
+ * at the new area. Whoever opens the image next installs it before
+ * anything else, with the image to itself.
+ */
+#define JOURNAL_RESIZING  0x1U
+
+_Static_assert(sizeof(struct superblock) == 128, "superblock must be 128 bytes");
+_Static_assert(sizeof(struct inode) == INODE_SIZE, "inode must be 128 bytes");
+_Static_assert(sizeof(struct dirent) == DIRENT_SIZE, "dirent must be 32 bytes");
+_Static_assert(sizeof(struct journal_header) == 32, "journal header must be 32 bytes");
+
+/*
+ * Journal length in blocks. mkfs places the journal in the blocks it
+ * reserves between the superblock and the inode bitmap; a resize past them
+ * moves it into a run of data blocks, which the data bitmap marks used.
+ */
+static inline uint32_t vsfs_journal_blocks(const struct superblock *sb) {
+    return sb->journal_blocks ? sb->journal_blocks : sb->inode_bitmap - sb->journal_block;
+}
+
+/* True when the journal lies inside the region mkfs reserved or the data region */
+static inline int vsfs_journal_placed(const struct superblock *sb) {
+    uint64_t end = (uint64_t)sb->journal_block + vsfs_journal_blocks(sb);
+
+    if (sb->journal_block >= JOURNAL_BLOCK_IDX && sb->journal_block < sb->inode_bitmap) {
+        return sb->journal_block < end && end <= sb->inode_bitmap;
+    }
+    return sb->journal_block >= sb->data_start && sb->journal_block < end && end <= sb->total_blocks;
+}
+
+/* Inode table block holding inode ino */
+static inline uint32_t vsfs_inode_block(const struct superblock *sb, uint32_t ino) {
+    return sb->inode_start + ino / INODES_PER_BLOCK;
+}
+
+/* Position of inode ino within its inode table block */
+static inline uint32_t vsfs_inode_slot(uint32_t ino) {
+    return ino % INODES_PER_BLOCK;
+}
+
+/* Byte offset of inode ino in the image */
+static inline uint64_t vsfs_inode_offset(const struct superblock *sb, uint32_t ino) {
+    return (uint64_t)sb->inode_start * BLOCK_SIZE + (uint64_t)ino * INODE_SIZE;
+}
+
+/* Directory entry e of a directory is in direct[e / DIRENTS_PER_BLOCK] */
+static inline uint32_t vsfs_dirent_block(uint32_t e) {
+    return e / DIRENTS_PER_BLOCK;
+}
+
+static inline uint32_t vsfs_dirent_slot(uint32_t e) {
+    return e % DIRENTS_PER_BLOCK;
+}
+
+/* Block of a bitmap starting at first_block that holds bit */
+static inline uint32_t vsfs_bitmap_block(uint32_t first_block, uint32_t bit) {
+    return first_block + bit / BITS_PER_BLOCK;
+}
+
+static inline uint32_t vsfs_bitmap_bit(uint32_t bit) {
+    return bit % BITS_PER_BLOCK;
+}
+
+/* Blocks needed for size bytes */
+static inline uint32_t vsfs_blocks(uint64_t size) {
+    return (uint32_t)((size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+}
+
+#endif